@@ -1,9 +1,243 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#ifndef CHIP8_COROUTINES
+#ifdef __cpp_impl_coroutine
+#define CHIP8_COROUTINES 1
+#else
+#define CHIP8_COROUTINES 0
+#endif
+#endif
+#if CHIP8_COROUTINES
+#include <coroutine>
+#include <utility>
+#include <map>
+#endif
+#ifndef CHIP8_GL
+#define CHIP8_GL 0
+#endif
+#if CHIP8_GL
+#define GL_GLEXT_PROTOTYPES
+#include <GL/freeglut.h>
+#include <GL/glext.h>
+#endif
 
 using namespace std;
 
+struct Chip8;
+struct Keypad;
+struct Trace;
+struct ExecLog;
+
+// Handler signature shared by every INSTRUCTION_LIST entry
+typedef void (*Handler)(Chip8* vm, unsigned x, unsigned y, unsigned n, unsigned kk, unsigned nnn);
+
+// Pre-decoded instruction: the handler plus its operand fields already masked out
+typedef struct Decoded {
+    Handler  exec;  // nullptr until first executed, or after invalidation
+    char16_t instr;
+    uint16_t nnn;
+    uint8_t  x, y, n, kk;
+} Decoded;
+
+// Program space covered by the pre-decoded cache, one entry per even address
+#define CACHE_BASE 0x200
+#define CACHE_SIZE ((4096 - CACHE_BASE) / 2)
+
+// XO-CHIP bitplanes
+#define PLANES 2
+
+// Each row is two 64-bit words, pixel x is bit (63 - x % 64) of word x / 64, so
+// the leftmost pixel is the MSB. Lores (64x32) only uses word 0 of rows 0 -- 31.
+typedef struct Display {
+    uint64_t rows[PLANES][64][2] = {};
+    bool     hires  = false;
+    uint8_t  planes = 1;        // Planes drawn, cleared and scrolled, bit p for plane p (Fn01)
+    uint64_t dirty  = 0;        // Rows touched since the last presentFrame(), bit y for row y
+} Display;
+
+/*
+    Random numbers
+    Every VM owns its generator, so parallel instances never share or lock RNG
+    state and a (seed, stream) pair always gives the same sequence. The
+    generator is xoshiro256** run as RANDOM_STREAMS interleaved streams with
+    their state stored word-major, so each step of refillRandom() is the same
+    few shifts, xors and adds on one vector per state word. Cxkk takes bytes
+    from the pool and refills it RANDOM_POOL bytes at a time.
+
+    seedRandom() expands (seed, stream) through SplitMix64 into the whole state.
+    Different streams of one seed are unrelated sequences; with a period of
+    2^256 per stream the chance of two of them overlapping is negligible.
+*/
+#define RANDOM_STREAMS 4
+#define RANDOM_POOL    256
+
+typedef struct Random {
+    uint64_t s[4][RANDOM_STREAMS] = {};   // xoshiro256** state word w of stream l at s[w][l]
+    uint8_t  pool[RANDOM_POOL]    = {};
+    uint16_t at                   = RANDOM_POOL;  // Next unread byte of pool
+} Random;
+
+uint64_t splitMix64 (uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void seedRandom (Random* r, uint64_t seed, uint64_t stream) {
+    uint64_t x = stream;
+    x = seed ^ splitMix64(&x);
+    for (unsigned w = 0; w < 4; w++) {
+        for (unsigned l = 0; l < RANDOM_STREAMS; l++) r->s[w][l] = splitMix64(&x);
+    }
+    r->at = RANDOM_POOL;
+}
+
+void refillRandom (Random* r) {
+    // Locals, so the byte stores into the pool can't alias the state
+    uint64_t s0[RANDOM_STREAMS], s1[RANDOM_STREAMS], s2[RANDOM_STREAMS], s3[RANDOM_STREAMS];
+    memcpy(s0, r->s[0], sizeof(s0));
+    memcpy(s1, r->s[1], sizeof(s1));
+    memcpy(s2, r->s[2], sizeof(s2));
+    memcpy(s3, r->s[3], sizeof(s3));
+
+    for (unsigned i = 0; i < RANDOM_POOL; i += 8 * RANDOM_STREAMS) {
+        uint64_t out[RANDOM_STREAMS];
+        for (unsigned l = 0; l < RANDOM_STREAMS; l++) {
+            uint64_t m = s1[l] + (s1[l] << 2);                // * 5
+            m = (m << 7) | (m >> 57);
+            out[l] = m + (m << 3);                            // * 9
+
+            uint64_t t = s1[l] << 17;
+            s2[l] ^= s0[l];
+            s3[l] ^= s1[l];
+            s1[l] ^= s2[l];
+            s0[l] ^= s3[l];
+            s2[l] ^= t;
+            s3[l] = (s3[l] << 45) | (s3[l] >> 19);
+        }
+        memcpy(r->pool + i, out, sizeof(out));
+    }
+
+    memcpy(r->s[0], s0, sizeof(s0));
+    memcpy(r->s[1], s1, sizeof(s1));
+    memcpy(r->s[2], s2, sizeof(s2));
+    memcpy(r->s[3], s3, sizeof(s3));
+    r->at = 0;
+}
+
+// Undo the steps of one refill on state s, so that refilling from the result
+// gives back the pool and the state it was taken from
+void rewindRandom (uint64_t s[4][RANDOM_STREAMS]) {
+    for (unsigned l = 0; l < RANDOM_STREAMS; l++) {
+        for (unsigned i = 0; i < RANDOM_POOL; i += 8 * RANDOM_STREAMS) {
+            uint64_t a  = (s[3][l] >> 45) | (s[3][l] << 19);  // s3 ^ s1
+            uint64_t u  = s[1][l] ^ s[2][l];                  // s1 ^ (s1 << 17)
+            uint64_t s1 = u ^ (u << 17) ^ (u << 34) ^ (u << 51);
+            uint64_t s0 = s[0][l] ^ a;
+            s[2][l] = s[1][l] ^ s1 ^ s0;
+            s[3][l] = a ^ s1;
+            s[1][l] = s1;
+            s[0][l] = s0;
+        }
+    }
+}
+
+uint8_t nextRandom (Random* r) {
+    if (r->at == RANDOM_POOL) refillRandom(r);
+    return r->pool[r->at++];
+}
+
+// Fontset -- "Cosmacvip", 5 bytes per hex digit from FONT_BASE, see Fx29
+#define FONT_BASE 0x000
+
+constexpr uint8_t fontset[80] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+};
+
+/*
+    Power-on state
+    powerOn is built at compile time: the fontset in place, every register,
+    the stack and both timers zero, and PC at 0x200. mapROM() lays each ROM over
+    a copy of its ram once, and reset() restores a VM from that image with the
+    handful of stores below, copying back only the ram that differs. Restarting
+    an instance needs no allocation, no file access and no construction of the
+    whole Chip8, and a restart with the same ROM keeps its decoded and translated
+    code.
+*/
+typedef struct PowerOn {
+    uint8_t  ram[4096];
+    uint8_t  V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t  SP;
+    uint16_t stack[16];
+    uint8_t  dTimer;
+    uint8_t  sTimer;
+} PowerOn;
+
+constexpr PowerOn makePowerOn () {
+    PowerOn image = {};
+    for (unsigned i = 0; i < sizeof(fontset); i++) image.ram[FONT_BASE + i] = fontset[i];
+    image.PC = 0x200;
+    return image;
+}
+
+constexpr PowerOn powerOn = makePowerOn();
+
+struct Recompiler;
+struct Profile;
+struct DispatchTable;
+
+// Dispatch table for the default CHIP-8 quirk profile
+const DispatchTable* defaultDispatch ();
+
 typedef struct Chip8 {
 /*	
     The Chip-8 language is capable of accessing up to 4KB (4,096 bytes) of RAM,
@@ -99,8 +333,13 @@ typedef struct Chip8 {
     // Stack
     uint16_t stack[16] = {};
 
-    // Display -- 64x32 pixels
-    bool display[64][32] = {};
+    // Display -- 64x32 pixels, or 128x64 in SCHIP hires mode
+    Display display;
+
+    // Display as of the last presentFrame(), [row][plane][word]. Only flagged rows
+    // are compared against it.
+    uint64_t presented[64][PLANES][2] = {};
+    bool     presentedHires           = false;
     
     // 8  bit Delay timer register @60Hz
     uint8_t dTimer = 0x00;
@@ -108,159 +347,5015 @@ typedef struct Chip8 {
     // 8 bit sound timer register @60Hz
     uint8_t sTimer = 0x00;
 
-    // Fontset -- "Cosmacvip"
-    uint8_t fontset[80] = {
-        0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1
-        0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-        0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-        0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-        0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-        0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-        0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-        0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-        0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-        0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-        0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-        0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-        0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-        0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-        0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
+    // Keypad -- keys held as of the last drainKeys(), bit k for key k, and keys
+    // pressed since then. `waiting` is set by Fx0A and by idle loops, nothing
+    // more can happen until the next tick or key.
+    uint16_t keys    = 0;
+    uint16_t pressed = 0;
+    bool     waiting = false;
+    Keypad*  keypad  = nullptr;
+
+    // Input trace being recorded or replayed, see traceEvent()
+    Trace*   trace   = nullptr;
+
+    // Cxkk's generator, seeded by initVM() with seed 0, stream 0
+    Random   rng;
+
+    // Handlers for this VM's quirk profile, see useQuirks()
+    const DispatchTable* dispatch = defaultDispatch();
+
+    // Pre-decoded instruction cache for 0x200 -- 0xFFF, filled lazily by step()
+    Decoded decoded[CACHE_SIZE] = {};
+
+    // Optional block recompiler sharing this state, notified of writes to ram
+    Recompiler* jit = nullptr;
+
+    // Execution profile, collected only in CHIP8_PROFILE builds
+    Profile* profile = nullptr;
+
+    // Instruction log being written, see logOp()
+    ExecLog* log     = nullptr;
+
+    // Per instruction slot (PC / 2) count of instructions runBlock() executed, for
+    // the fuzzer's coverage
+    uint32_t* hits   = nullptr;
+
+    // Instructions executed, the one running included
+    uint64_t cycles = 0;
+
+    // A fused pair reaching this cycle count stops after its first instruction,
+    // so an instruction budget is met exactly
+    uint64_t deadline = UINT64_MAX;
+
+    // 256 byte ram pages written since the snapshot named by `base`, bit p for page p
+    uint16_t dirtyPages = 0;
+    uint64_t base       = 0;
 
 } Chip8;
 
-// Load Chip-8 ROM file into memory, starting at 0x200
-void loadROM(char const* filename, Chip8* vm) {
-    ifstream file(filename, ios::binary | ios::ate);
+void recompilerInvalidate (Recompiler* jit, unsigned addr, unsigned end);
+uint8_t randomByte (Chip8* vm);
 
-    if (file.is_open()) {
-        streamsize fileSize = file.tellg();
-        
-        // Create a buffer as large as the ROM file
-        vector<char> buffer(fileSize);
-        
-        // Read file into buffer
-        file.seekg(0, ios::beg);
-        file.read(buffer.data(), fileSize);
-        file.close();
-        
-        // Read the ROM into memory
-        for (int i = 0; i < fileSize; i++) {
-            vm->ram[i + 0x200] = buffer[i];
-        }
+// Drop cached decodes overlapping ram[addr .. addr+len), call after any write to ram
+void invalidate (Chip8* vm, unsigned addr, unsigned len) {
+    for (unsigned i = 0; i < len; i += 256) {
+        vm->dirtyPages |= 1u << (((addr + i) & 0xFFF) >> 8);
+    }
+    if (len) vm->dirtyPages |= 1u << (((addr + len - 1) & 0xFFF) >> 8);
+
+    unsigned end = addr + len;
+    if (addr < CACHE_BASE) addr = CACHE_BASE;
+    if (end > 4096) end = 4096;
+
+    // An instruction at an even address a spans ram[a] and ram[a+1], a fused
+    // pair starting there also ram[a+2] and ram[a+3]
+    unsigned from = addr & ~1u;
+    if (from > CACHE_BASE) from -= 2;
+    for (unsigned a = from; a < end; a += 2) {
+        vm->decoded[(a - CACHE_BASE) >> 1].exec = nullptr;
+    }
+    if (vm->jit && addr < end) recompilerInvalidate(vm->jit, addr, end);
+}
+
+// Copy back from image[4096] the span of each page p in `pages` that differs, so
+// decoded and translated code outside it survives
+void restoreRAM (Chip8* vm, const uint8_t* image, uint16_t pages) {
+    for (; pages; pages &= pages - 1) {
+        unsigned first = __builtin_ctz(pages) * 256, last = first + 255;
+        if (memcmp(vm->ram + first, image + first, 256) == 0) continue;
+        while (first <= last && vm->ram[first] == image[first]) first++;
+        while (last > first && vm->ram[last] == image[last]) last--;
+        if (first > last) continue;
+        memcpy(vm->ram + first, image + first, last - first + 1);
+        invalidate(vm, first, last - first + 1);
+    }
+}
+
+// Largest ROM that fits the 0x200 -- 0xFFF program space
+#define ROM_MAX (4096 - 0x200)
+
+// Read-only ROM contents, shared by every VM loading the same file
+typedef struct ROMImage {
+    const uint8_t* data;
+    size_t         size;
+    const uint8_t* ram;   // powerOn.ram with the ROM at 0x200
+} ROMImage;
+
+// Map a ROM file and build its power-on ram, once per process. Later calls for
+// the same path are served from the cache without touching the filesystem.
+// Files that are empty or do not fit the program space are rejected.
+bool mapROM (char const* filename, ROMImage* image) {
+    static mutex lock;
+    static unordered_map<string, ROMImage> cache;
+
+    lock_guard<mutex> guard(lock);
+    auto cached = cache.find(filename);
+    if (cached != cache.end()) {
+        *image = cached->second;
+        return true;
+    }
+
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0 || info.st_size > ROM_MAX) {
+        close(fd);
+        return false;
     }
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    image->data = (const uint8_t*)data;
+    image->size = info.st_size;
+#else
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file.is_open()) return false;
+
+    streamsize fileSize = file.tellg();
+    if (fileSize <= 0 || fileSize > ROM_MAX) return false;
+
+    uint8_t* data = new uint8_t[fileSize];
+    file.seekg(0, ios::beg);
+    file.read((char*)data, fileSize);
+
+    image->data = data;
+    image->size = fileSize;
+#endif
+    uint8_t* ram = new uint8_t[4096];
+    memcpy(ram, powerOn.ram, sizeof(powerOn.ram));
+    memcpy(ram + 0x200, image->data, image->size);
+    image->ram = ram;
+
+    cache[filename] = *image;
+    return true;
+}
+
+// Load Chip-8 ROM file into memory, starting at 0x200
+bool loadROM(char const* filename, Chip8* vm) {
+    ROMImage image;
+    if (!mapROM(filename, &image)) return false;
+
+    memcpy(vm->ram + 0x200, image.data, image.size);
+    invalidate(vm, 0x200, image.size);
+    return true;
 }
 // Grab opcode, Increment Program Counter
 void fetch (Chip8* vm) {
-    // Grab first byte of instruction
-    vm->instr = vm->ram[vm->PC];
+    // Grab first byte of instruction, addresses wrap at 4K
+    vm->instr = vm->ram[vm->PC & 0xFFF];
     // Shift and grab second byte of instruction
-    vm->instr = (vm->instr<<8) | vm->ram[(vm->PC+1)]; 
+    vm->instr = (vm->instr<<8) | vm->ram[(vm->PC+1) & 0xFFF]; 
     // Increment Program Counter
     vm->PC += 2;
 }
-// Reset Chip-8 Display
-void reset (bool arr[64][32]) {
-    for (int i = 0; i<64; i++) {
-        for (int j = 0; j<32; j++) {
-            arr[i][j] = 0;
+// Reset Chip-8 Display, clearing the selected planes
+void reset (Display* d) {
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        for (unsigned y = 0; y < 64; y++) {
+            if (d->rows[p][y][0] | d->rows[p][y][1]) d->dirty |= 1ull << y;
+        }
+        memset(d->rows[p], 0, sizeof(d->rows[p]));
+    }
+}
+
+unsigned displayWidth  (const Display* d) { return d->hires ? 128 : 64; }
+unsigned displayHeight (const Display* d) { return d->hires ? 64 : 32; }
+
+// Flag every row of the current resolution
+void touchAll (Display* d) {
+    d->dirty |= d->hires ? ~0ull : 0xFFFFFFFFull;
+}
+
+// Power an existing VM on with rom loaded, as initVM() leaves a new one. The quirk
+// profile and everything attached (keypad, trace, recompiler, profile, log and
+// coverage) are kept.
+void reset (Chip8* vm, const ROMImage* rom) {
+    restoreRAM(vm, rom->ram, 0xFFFF);
+
+    memcpy(vm->V, powerOn.V, sizeof(vm->V));
+    memcpy(vm->stack, powerOn.stack, sizeof(vm->stack));
+    vm->I      = powerOn.I;
+    vm->PC     = powerOn.PC;
+    vm->SP     = powerOn.SP;
+    vm->dTimer = powerOn.dTimer;
+    vm->sTimer = powerOn.sTimer;
+    vm->instr  = 0;
+
+    // Clear every plane, flagging the rows that were lit
+    vm->display.planes = (1 << PLANES) - 1;
+    reset(&vm->display);
+    vm->display.hires  = false;
+    vm->display.planes = 1;
+
+    vm->keys     = 0;
+    vm->pressed  = 0;
+    vm->waiting  = false;
+    vm->rng      = Random();
+    seedRandom(&vm->rng, 0, 0);
+    vm->cycles   = 0;
+    vm->deadline = UINT64_MAX;
+}
+
+// As above for a ROM file, mapped on first use and served from memory after that
+bool reset (Chip8* vm, const char* rom) {
+    ROMImage image;
+    if (!mapROM(rom, &image)) return false;
+    reset(vm, &image);
+    return true;
+}
+
+// Read back pixel (x, y) of a plane
+bool pixel (const Display* d, unsigned x, unsigned y, unsigned plane = 0) {
+    x &= displayWidth(d) - 1;
+    y &= displayHeight(d) - 1;
+    return (d->rows[plane][y][x >> 6] >> (63 - (x & 63))) & 1;
+}
+
+// Move left aligned sprite bits to column col of a row. Lores rows are one word
+// and the bits rotate within it; hires rows are two words and bits spill into
+// the other word, which also wraps the right edge back to the left.
+void placeSprite (uint64_t bits, unsigned col, bool hires, uint64_t out[2]) {
+    if (!hires) {
+        out[0] = col ? (bits >> col) | (bits << (64 - col)) : bits;
+        out[1] = 0;
+        return;
+    }
+    unsigned w = col >> 6, s = col & 63;
+    out[w]     = bits >> s;
+    out[w ^ 1] = s ? bits << (64 - s) : 0;
+}
+
+// XOR a sprite from ram[I] into one plane at (col, row). Sprites are 8 pixels wide
+// and n rows tall, or 16x16 from 32 bytes when n is 0. Each sprite row is placed
+// into its row words in one operation. Returns the collision bits.
+uint64_t blit (Display* d, unsigned plane, const uint8_t ram[4096], unsigned I,
+               unsigned col, unsigned row, unsigned n) {
+    bool     wide   = n == 0;
+    unsigned lines  = wide ? 16 : n;
+    unsigned height = displayHeight(d);
+    uint64_t hit    = 0;
+
+    col &= displayWidth(d) - 1;
+    row &= height - 1;
+    for (unsigned i = 0; i < lines; i++) {
+        uint64_t bits = wide ? ((uint64_t)ram[(I + 2 * i) & 0xFFF] << 56) | ((uint64_t)ram[(I + 2 * i + 1) & 0xFFF] << 48)
+                             :  (uint64_t)ram[(I + i) & 0xFFF] << 56;
+        uint64_t sprite[2];
+        placeSprite(bits, col, d->hires, sprite);
+
+        unsigned  r    = (row + i) & (height - 1);
+        uint64_t* line = d->rows[plane][r];
+        hit     |= (line[0] & sprite[0]) | (line[1] & sprite[1]);
+        line[0] ^= sprite[0];
+        line[1] ^= sprite[1];
+        if (bits) d->dirty |= 1ull << r;
+    }
+    return hit;
+}
+
+// Dxyn -- draw on every selected plane, each plane taking the next sprite's worth
+// of bytes after I. Returns true if any lit pixel was cleared.
+bool drawSprite (Display* d, const uint8_t ram[4096], unsigned I, unsigned col, unsigned row, unsigned n) {
+    uint64_t hit = 0;
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        hit |= blit(d, p, ram, I, col, row, n);
+        I   += n ? n : 32;
+    }
+    return hit != 0;
+}
+
+void draw (Chip8* vm, unsigned x, unsigned y, unsigned n) {
+    vm->V[0xF] = drawSprite(&vm->display, vm->ram, vm->I, vm->V[x], vm->V[y], n);
+}
+
+// 00Cn / 00Dn -- scroll the selected planes down / up by n rows
+void scrollDown (Display* d, unsigned n) {
+    unsigned height = displayHeight(d);
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        memmove(d->rows[p] + n, d->rows[p], (height - n) * sizeof(d->rows[p][0]));
+        memset(d->rows[p], 0, n * sizeof(d->rows[p][0]));
+    }
+    touchAll(d);
+}
+
+void scrollUp (Display* d, unsigned n) {
+    unsigned height = displayHeight(d);
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        memmove(d->rows[p], d->rows[p] + n, (height - n) * sizeof(d->rows[p][0]));
+        memset(d->rows[p] + height - n, 0, n * sizeof(d->rows[p][0]));
+    }
+    touchAll(d);
+}
+
+// 00FB / 00FC -- scroll the selected planes 4 pixels right / left, as word shifts
+void scrollRight (Display* d) {
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        for (unsigned y = 0; y < displayHeight(d); y++) {
+            uint64_t* line = d->rows[p][y];
+            if (d->hires) line[1] = (line[1] >> 4) | (line[0] << 60);
+            line[0] >>= 4;
+        }
+    }
+    touchAll(d);
+}
+
+void scrollLeft (Display* d) {
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (!((d->planes >> p) & 1)) continue;
+        for (unsigned y = 0; y < displayHeight(d); y++) {
+            uint64_t* line = d->rows[p][y];
+            line[0] <<= 4;
+            if (d->hires) {
+                line[0] |= line[1] >> 60;
+                line[1] <<= 4;
+            }
+        }
+    }
+    touchAll(d);
+}
+
+// 00FE / 00FF -- switch resolution, clearing every plane
+void setHires (Display* d, bool hires) {
+    d->hires = hires;
+    memset(d->rows, 0, sizeof(d->rows));
+    d->dirty = ~0ull;
+}
+
+// Scaled render path: row y of a plane at 128x64 whatever the mode, lores
+// pixels doubled in both directions by spreading each bit over two
+uint64_t spreadBits (uint32_t v) {
+    uint64_t x = v;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x | (x << 1);
+}
+
+void scaledRow (const Display* d, unsigned plane, unsigned y, uint64_t out[2]) {
+    if (d->hires) {
+        out[0] = d->rows[plane][y & 63][0];
+        out[1] = d->rows[plane][y & 63][1];
+        return;
+    }
+    uint64_t line = d->rows[plane][(y & 63) >> 1][0];
+    out[0] = spreadBits(line >> 32);
+    out[1] = spreadBits(line & 0xFFFFFFFF);
+}
+
+// Rows that differ from the previously presented frame
+typedef struct FrameDelta {
+    uint64_t mask;                  // Bit y set if row y changed
+    unsigned count;                 // Number of changed rows
+    bool     hires;                 // 128x64 frame, else 64x32
+    bool     resized;               // Resolution changed, every row is included
+    uint8_t  index[64];             // Row number of each changed row, ascending
+    uint64_t rows[64][PLANES][2];   // New contents of each changed row, per plane
+} FrameDelta;
+
+// Collect the rows that changed since the last call and mark them presented.
+// Only rows flagged dirty are compared, a row drawn and then erased again
+// within one frame is not reported.
+unsigned presentFrame (Chip8* vm, FrameDelta* delta) {
+    Display* d     = &vm->display;
+    uint64_t dirty = d->dirty;
+
+    delta->mask    = 0;
+    delta->count   = 0;
+    delta->hires   = d->hires;
+    delta->resized = d->hires != vm->presentedHires;
+    if (delta->resized) {
+        dirty = d->hires ? ~0ull : 0xFFFFFFFFull;
+        vm->presentedHires = d->hires;
+    }
+
+    for (; dirty; dirty &= dirty - 1) {
+        unsigned y = __builtin_ctzll(dirty);
+        bool same = !delta->resized;
+        for (unsigned p = 0; p < PLANES; p++) {
+            same &= vm->presented[y][p][0] == d->rows[p][y][0] && vm->presented[y][p][1] == d->rows[p][y][1];
+        }
+        if (same) continue;
+
+        for (unsigned p = 0; p < PLANES; p++) {
+            vm->presented[y][p][0]            = d->rows[p][y][0];
+            vm->presented[y][p][1]            = d->rows[p][y][1];
+            delta->rows[delta->count][p][0]   = d->rows[p][y][0];
+            delta->rows[delta->count][p][1]   = d->rows[p][y][1];
+        }
+        delta->mask                |= 1ull << y;
+        delta->index[delta->count++] = y;
+    }
+    d->dirty = 0;
+    return delta->count;
+}
+
+// Fx0A -- take the lowest key pressed since the last drain, otherwise stay on
+// this instruction and flag the VM as waiting so the scheduler parks it
+void waitKey (Chip8* vm, unsigned x) {
+    if (vm->pressed) {
+        vm->V[x] = __builtin_ctz(vm->pressed);
+        vm->pressed &= vm->pressed - 1;
+        return;
+    }
+    vm->PC -= 2;
+    vm->waiting = true;
+}
+
+/*
+    Idle loops
+    A backward jump over a short loop whose only inputs are the delay timer and
+    the keys can't do anything new until one of them changes: checked when the
+    jump is taken, it flags the VM waiting and the scheduler skips ahead to the
+    next tick. The body may only hold
+
+        Fx07, 6xkk          unconditional writes of a timer value or constant
+        3xkk, 4xkk, 5xy0,   skips, each followed by another skip or the jump,
+        9xy0, Ex9E, ExA1    reading registers set earlier in the body or not at all
+
+    so every pass through it repeats the last one exactly. A jump to itself is the
+    empty loop.
+*/
+#define IDLE_SPAN 8   // Longest loop body checked, in instructions
+
+bool idleLoop (const uint8_t* ram, unsigned start, unsigned end) {
+    uint16_t writes = 0;
+    for (unsigned a = start; a < end; a += 2) {
+        unsigned instr = (ram[a & 0xFFF] << 8) | ram[(a + 1) & 0xFFF];
+        unsigned u = instr >> 12, x = (instr >> 8) & 0xF, kk = instr & 0xFF;
+        if (u == 0x6 || (u == 0xF && kk == 0x07)) writes |= 1u << x;
+    }
+
+    uint16_t set  = 0;
+    bool     skip = false;   // Previous instruction was a skip
+    for (unsigned a = start; a < end; a += 2) {
+        unsigned instr = (ram[a & 0xFFF] << 8) | ram[(a + 1) & 0xFFF];
+        unsigned u = instr >> 12, x = (instr >> 8) & 0xF, y = (instr >> 4) & 0xF;
+        unsigned n = instr & 0xF, kk = instr & 0xFF;
+        uint16_t reads = 0;
+
+        switch (u) {
+            case 0x6: if (skip) return false; set |= 1u << x; continue;
+            case 0x3: case 0x4: reads = 1u << x; break;
+            case 0x5: case 0x9: if (n) return false; reads = (1u << x) | (1u << y); break;
+            case 0xE: if (kk != 0x9E && kk != 0xA1) return false; reads = 1u << x; break;
+            case 0xF:
+                if (kk != 0x07 || skip) return false;
+                set |= 1u << x;
+                continue;
+            default:  return false;
         }
+        if (reads & writes & ~set) return false;
+        skip = true;
+    }
+    return true;
+}
+
+// A jump at `from` back to `to` closing an idle loop
+bool idleJump (const uint8_t* ram, unsigned from, unsigned to) {
+    return to <= from && from - to <= 2 * IDLE_SPAN && idleLoop(ram, to, from);
+}
+
+// 1nnn -- jump, noticing idle loops
+void jump (Chip8* vm, unsigned nnn) {
+    unsigned from = vm->PC - 2;
+    vm->PC = nnn;
+    if (idleJump(vm->ram, from, nnn)) vm->waiting = true;
+}
+
+// Fx33 -- BCD of Vx into ram[I], ram[I+1], ram[I+2]
+void storeBCD (Chip8* vm, unsigned x) {
+    vm->ram[(vm->I + 0) & 0xFFF] = vm->V[x] / 100;
+    vm->ram[(vm->I + 1) & 0xFFF] = vm->V[x] / 10 % 10;
+    vm->ram[(vm->I + 2) & 0xFFF] = vm->V[x] % 10;
+    invalidate(vm, vm->I & 0xFFF, 3);
+}
+
+/*
+    Quirk profiles
+    The interpreters disagree on a handful of opcodes (the ¹ footnotes below).
+    Each profile is a set of compile time constants; INSTRUCTION_LIST is expanded
+    once per profile, so every handler is specialized and never tests a quirk
+    at run time.
+
+        shiftVy        8xy6 / 8xyE shift VY into VX, rather than shifting VX
+        jumpVx         Bnnn jumps to XNN + VX, rather than NNN + V0
+        indexIncrement Fx55 / Fx65 leave I at I + X + 1
+        logicResetsVF  8xy1 / 8xy2 / 8xy3 clear VF
+*/
+typedef struct QuirksChip8 {
+    static constexpr bool shiftVy        = true;
+    static constexpr bool jumpVx         = false;
+    static constexpr bool indexIncrement = true;
+    static constexpr bool logicResetsVF  = true;
+} QuirksChip8;
+
+typedef struct QuirksSchip {
+    static constexpr bool shiftVy        = false;
+    static constexpr bool jumpVx         = true;
+    static constexpr bool indexIncrement = false;
+    static constexpr bool logicResetsVF  = false;
+} QuirksSchip;
+
+typedef struct QuirksXOChip {
+    static constexpr bool shiftVy        = true;
+    static constexpr bool jumpVx         = false;
+    static constexpr bool indexIncrement = true;
+    static constexpr bool logicResetsVF  = false;
+} QuirksXOChip;
+
+// 8xy6 -- VF is written last so it wins when X is F
+template <typename Q>
+void shiftRight (Chip8* vm, unsigned x, unsigned y) {
+    uint8_t src  = Q::shiftVy ? vm->V[y] : vm->V[x];
+    vm->V[x]     = src >> 1;
+    vm->V[0xF]   = src & 1;
+}
+
+// 8xyE
+template <typename Q>
+void shiftLeft (Chip8* vm, unsigned x, unsigned y) {
+    uint8_t src  = Q::shiftVy ? vm->V[y] : vm->V[x];
+    vm->V[x]     = src << 1;
+    vm->V[0xF]   = src >> 7;
+}
+
+// Fx55 -- V0..Vx into ram starting at I
+template <typename Q>
+void storeRegisters (Chip8* vm, unsigned x) {
+    for (unsigned i = 0; i <= x; i++) {
+        vm->ram[(vm->I + i) & 0xFFF] = vm->V[i];
     }
-} 
+    invalidate(vm, vm->I & 0xFFF, x + 1);
+    if constexpr (Q::indexIncrement) vm->I += x + 1;
+}
 
-void draw (const uint8_t* x, const uint8_t* y, const uint8_t* n, const uint16_t* I) {
-        
+// Fx65 -- ram starting at I into V0..Vx
+template <typename Q>
+void loadRegisters (Chip8* vm, unsigned x) {
+    for (unsigned i = 0; i <= x; i++) {
+        vm->V[i] = vm->ram[(vm->I + i) & 0xFFF];
+    }
+    if constexpr (Q::indexIncrement) vm->I += x + 1;
 }
 #define INSTRUCTION_LIST(o)\
-    o("SYS addr",           "0nnn", )/*Execute machine language subroutine at address NNN*/\
-    o("CLS",                "00E0", u == 0x0 && kk == 0xE0, reset(vm->display))/*Clear the screen*/\
-    o("RET",                "00EE", u == 0x0 && kk == 0xEE, )/*Return from a subroutine*/\
-    o("JP addr",            "1nnn", u == 0x1, vm->PC = nnn)/*Jump to address NNN*/\
-    o("CALL addr",          "2nnn", u == 0x2, )/*Execute subroutine starting at address NNN*/\
-    o("SE Vx, byte",        "3xkk", u == 0x3, if (vm->V[x] == nn)  vm->PC += 2 )/*Skip the following instruction if the value of register VX equals NN*/\
-    o("SNE Vx, byte",       "4xkk", u == 0x4, if (vm->V[x] != nn)  vm->PC += 2 )/*Skip the following instruction if the value of register VX is not equal to NN*/\
-    o("SE Vx, Vy",          "5xy0", u == 0x5, if (vm->V[x] == V[y] vm->PC += 2 ))/*Skip the following instruction if the value of register VX is equal to the value 
+    o("CLS",                "00E0", u == 0x0 && kk == 0xE0, reset(&vm->display))/*Clear the screen*/\
+    o("RET",                "00EE", u == 0x0 && kk == 0xEE, vm->PC = vm->stack[--vm->SP & 0xF])/*Return from a subroutine*/\
+    o("SCD nibble",         "00Cn", u == 0x0 && (kk & 0xF0) == 0xC0, scrollDown(&vm->display, n))/*SCHIP: Scroll the display down N rows*/\
+    o("SCU nibble",         "00Dn", u == 0x0 && (kk & 0xF0) == 0xD0, scrollUp(&vm->display, n))/*XO-CHIP: Scroll the display up N rows*/\
+    o("SCR",                "00FB", u == 0x0 && kk == 0xFB, scrollRight(&vm->display))/*SCHIP: Scroll the display right 4 pixels*/\
+    o("SCL",                "00FC", u == 0x0 && kk == 0xFC, scrollLeft(&vm->display))/*SCHIP: Scroll the display left 4 pixels*/\
+    o("EXIT",               "00FD", u == 0x0 && kk == 0xFD, vm->PC -= 2; vm->waiting = true)/*SCHIP: Exit the interpreter, halts on this instruction*/\
+    o("LOW",                "00FE", u == 0x0 && kk == 0xFE, setHires(&vm->display, false))/*SCHIP: Switch to 64x32 and clear the display*/\
+    o("HIGH",               "00FF", u == 0x0 && kk == 0xFF, setHires(&vm->display, true))/*SCHIP: Switch to 128x64 and clear the display*/\
+    o("SYS addr",           "0nnn", u == 0x0, )/*Execute machine language subroutine at address NNN
+                                                            Listed after every 00xx opcode so it only takes what they don't*/\
+    o("JP addr",            "1nnn", u == 0x1, jump(vm, nnn))/*Jump to address NNN*/\
+    o("CALL addr",          "2nnn", u == 0x2, vm->stack[vm->SP++ & 0xF] = vm->PC; vm->PC = nnn)/*Execute subroutine starting at address NNN*/\
+    o("SE Vx, byte",        "3xkk", u == 0x3, if (vm->V[x] == kk)  vm->PC += 2 )/*Skip the following instruction if the value of register VX equals NN*/\
+    o("SNE Vx, byte",       "4xkk", u == 0x4, if (vm->V[x] != kk)  vm->PC += 2 )/*Skip the following instruction if the value of register VX is not equal to NN*/\
+    o("SE Vx, Vy",          "5xy0", u == 0x5, if (vm->V[x] == vm->V[y]) vm->PC += 2 )/*Skip the following instruction if the value of register VX is equal to the value 
                                                             of register VY*/\
-    o("LD Vx, byte",        "6xkk", u == 0x6, V[x] = kk)/*Store number NN in register VX*/\
-    o("ADD Vx, byte",       "7xkk", u == 0x7, V[x] += kk)/*Add the value NN to register VX*/\
+    o("LD Vx, byte",        "6xkk", u == 0x6, vm->V[x] = kk)/*Store number NN in register VX*/\
+    o("ADD Vx, byte",       "7xkk", u == 0x7, vm->V[x] += kk)/*Add the value NN to register VX*/\
     o("LD Vx, Vy",          "8xy0", u == 0x8 && n == 0x0, vm->V[x] = vm->V[y])/*Store the value of register VY in register VX*/\
-    o("OR Vx, Vy",          "8xy1", u == 0x8 && n == 0x1, vm->V[x] = vm->V[x] | vm->V[y])/*Set VX to VX OR VY*/\
-    o("AND Vx, Vy",         "8xy2", u == 0x8 && n == 0x2, vm->V[x] = vm->V[x] & vm->V[y])/*Set VX to VX AND VY*/\
-    o("XOR Vx, Vy",         "8xy3", u == 0x8 && n == 0x3, vm->V[x] = vm->V[x] ^ vm->V[y])/*Set VX to VX XOR VY*/\
-    o("ADD Vx, Vy",         "8xy4", u == 0x8 && n == 0x4, )/*Add the value of register VY to register VX
+    o("OR Vx, Vy",          "8xy1", u == 0x8 && n == 0x1, vm->V[x] |= vm->V[y]; if constexpr (Q::logicResetsVF) vm->V[0xF] = 0)/*Set VX to VX OR VY*/\
+    o("AND Vx, Vy",         "8xy2", u == 0x8 && n == 0x2, vm->V[x] &= vm->V[y]; if constexpr (Q::logicResetsVF) vm->V[0xF] = 0)/*Set VX to VX AND VY*/\
+    o("XOR Vx, Vy",         "8xy3", u == 0x8 && n == 0x3, vm->V[x] ^= vm->V[y]; if constexpr (Q::logicResetsVF) vm->V[0xF] = 0)/*Set VX to VX XOR VY*/\
+    o("ADD Vx, Vy",         "8xy4", u == 0x8 && n == 0x4, unsigned sum = vm->V[x] + vm->V[y]; vm->V[x] = sum; vm->V[0xF] = sum >> 8)/*Add the value of register VY to register VX
                                                             Set VF to 01 if a carry occurs
                                                             Set VF to 00 if a carry does not occur*/\
-    o("SUB Vx, Vy",         "8xy5", u == 0x8 && n == 0x5, )/*Subtract the value of register VY from register VX
+    o("SUB Vx, Vy",         "8xy5", u == 0x8 && n == 0x5, bool flag = vm->V[x] >= vm->V[y]; vm->V[x] -= vm->V[y]; vm->V[0xF] = flag)/*Subtract the value of register VY from register VX
                                                             Set VF to 00 if a borrow occurs
                                                             Set VF to 01 if a borrow does not occur*/\
-    o("SHR Vx {, Vy}",      "8xy6", u == 0x8 && n == 0x6, )/*Store the value of register VY shifted right one bit in register VX¹
+    o("SHR Vx {, Vy}",      "8xy6", u == 0x8 && n == 0x6, shiftRight<Q>(vm, x, y))/*Store the value of register VY shifted right one bit in register VX¹
                                                             Set register VF to the least significant bit prior to the shift
                                                             VY is unchanged*/\
-    o("SUBN Vx, Vy",        "8xy7", u == 0x8 && n == 0x7, )/*Set register VX to the value of VY minus VX
+    o("SUBN Vx, Vy",        "8xy7", u == 0x8 && n == 0x7, bool flag = vm->V[y] >= vm->V[x]; vm->V[x] = vm->V[y] - vm->V[x]; vm->V[0xF] = flag)/*Set register VX to the value of VY minus VX
                                                             Set VF to 00 if a borrow occurs
                                                             Set VF to 01 if a borrow does not occur*/\
-    o("SHL Vx {, Vy}",      "8xyE", u == 0x8 && n == 0xE, )/*Store the value of register VY shifted left one bit in register VX¹
+    o("SHL Vx {, Vy}",      "8xyE", u == 0x8 && n == 0xE, shiftLeft<Q>(vm, x, y))/*Store the value of register VY shifted left one bit in register VX¹
                                                             Set register VF to the most significant bit prior to the shift
                                                             VY is unchanged*/\
-    o("SNE Vx, Vy",         "9xy0", u == 0x9, if (vm->V[x] != vm->V[y]) { vm->PC += 2 })/*Skip the following instruction if the value of register VX is not equal to the 
+    o("SNE Vx, Vy",         "9xy0", u == 0x9, if (vm->V[x] != vm->V[y]) vm->PC += 2 )/*Skip the following instruction if the value of register VX is not equal to the 
                                                            value of register VY*/\
-    o("LD I, addr",         "Annn", u == 0xA , vm->I = nnn)/*Store memory address NNN in register I*/\
-    o("JP V0, addr",        "Bnnn", u == 0xB, )/*Jump to address NNN + V0*/\
-    o("RND Vx, byte",       "Cxkk",)/*Set VX to a random number with a mask of NN*/\
-    o("DRW Vx, Vy, nibble", "Dxyn", u == 0xD, draw (x, y, n, I)) /*Draw a sprite at position VX, VY with N bytes of sprite data starting at the 
-                                                            address stored in I
+    o("LD I, addr",         "Annn", u == 0xA, vm->I = nnn)/*Store memory address NNN in register I*/\
+    o("JP V0, addr",        "Bnnn", u == 0xB, vm->PC = (nnn + vm->V[Q::jumpVx ? x : 0]) & 0xFFF)/*Jump to address NNN + V0¹*/\
+    o("RND Vx, byte",       "Cxkk", u == 0xC, vm->V[x] = randomByte(vm) & kk)/*Set VX to a random number with a mask of NN*/\
+    o("DRW Vx, Vy, nibble", "Dxyn", u == 0xD, draw (vm, x, y, n)) /*Draw a sprite at position VX, VY with N bytes of sprite data starting at the 
+                                                            address stored in I. Dxy0 draws a 16x16 sprite from 32 bytes
                                                             Set VF to 01 if any set pixels are changed to unset, and 00 otherwise*/\
-    o("SKP Vx",             "Ex9E", u == 0xE, )/*Skip the following instruction if the key corresponding to the hex value 
+    o("SKP Vx",             "Ex9E", u == 0xE && kk == 0x9E, if (vm->keys >> (vm->V[x] & 0xF) & 1) vm->PC += 2)/*Skip the following instruction if the key corresponding to the hex value 
                                                            currently stored register VX is pressed*/\
+    o("SKNP Vx",            "ExA1", u == 0xE && kk == 0xA1, if (!(vm->keys >> (vm->V[x] & 0xF) & 1)) vm->PC += 2)/*Skip the following instruction if the key corresponding to the hex value 
+                                                           currently stored register VX is not pressed*/\
+    o("PLANE n",            "Fn01", u == 0xF && kk == 0x01, vm->display.planes = x & 3)/*XO-CHIP: Select the bitplanes drawn, cleared and scrolled*/\
     o("LD Vx, DT",          "Fx07", u == 0xF && kk == 0x07, vm->V[x] = vm->dTimer)/*Store the current value of the delay timer in register VX*/\
-    o("LD Vx, K",           "Fx0A", u == 0xF && kk == 0x0A, )/*Wait for a keypress and store the result in register VX*/\
+    o("LD Vx, K",           "Fx0A", u == 0xF && kk == 0x0A, waitKey(vm, x))/*Wait for a keypress and store the result in register VX*/\
     o("LD DT, Vx",          "Fx15", u == 0xF && kk == 0x15, vm->dTimer = vm->V[x])/*Set the delay timer to the value of register VX*/\
     o("LD ST, Vx",          "Fx18", u == 0xF && kk == 0x18, vm->sTimer = vm->V[x])/*Set the sound timer to the value of register VX*/\
-    o("ADD I, Vx",          "Fx1E", u == 0xF && kk == 0x1E, vm->V[x] += vm->I)/*Add the value stored in register VX to register I*/\
-    o("LD F, Vx",           "Fx29", u == 0xF && kk == 0x29, )/*Set I to the memory address of the sprite data corresponding to the hexadecimal 
+    o("ADD I, Vx",          "Fx1E", u == 0xF && kk == 0x1E, vm->I += vm->V[x])/*Add the value stored in register VX to register I*/\
+    o("LD F, Vx",           "Fx29", u == 0xF && kk == 0x29, vm->I = FONT_BASE + (vm->V[x] & 0xF) * 5)/*Set I to the memory address of the sprite data corresponding to the hexadecimal 
                                                            digit stored in register VX*/\
-    o("LD B, Vx",           "Fx33", u == 0xF && kk == 0x33, )/*Store the binary-coded decimal equivalent of the value stored in register VX at 
+    o("LD B, Vx",           "Fx33", u == 0xF && kk == 0x33, storeBCD(vm, x))/*Store the binary-coded decimal equivalent of the value stored in register VX at 
                                                             addresses I, I + 1, and I + 2*/\
-    o("LD [I], Vx",         "Fx55", u == 0xF && kk == 0x55, )/*Store the values of registers V0 to VX inclusive in memory starting at address I
+    o("LD [I], Vx",         "Fx55", u == 0xF && kk == 0x55, storeRegisters<Q>(vm, x))/*Store the values of registers V0 to VX inclusive in memory starting at address I
                                                             I is set to I + X + 1 after operation*/\
-    o("LD Vx, [I]",         "Fx65", u == 0xF && kk == 0x65, )/*Fill registers V0 to VX inclusive with the values stored in memory starting at 
+    o("LD Vx, [I]",         "Fx65", u == 0xF && kk == 0x65, loadRegisters<Q>(vm, x))/*Fill registers V0 to VX inclusive with the values stored in memory starting at 
                                                            address I. I is set to I + X + 1 after operation*/
 
-// Decode current instruction, then execute instruction
-void decode (Chip8* vm) {
-    unsigned u   = vm->instr & OP; // u - First 4 bits of instruction
-    unsigned x   = vm->instr & Vx; // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
-    unsigned y   = vm->instr & Vy; // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
-    unsigned n   = vm->instr & N;  // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
-    unsigned kk  = vm->instr & NN; // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
-    unsigned nnn = vm->instr & NNN;// nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
+// Match predicate for an INSTRUCTION_LIST entry, used only to build the dispatch tables
+typedef bool (*Predicate)(unsigned u, unsigned x, unsigned y, unsigned n, unsigned kk, unsigned nnn);
 
-    // Execute instruction based on opcode
-    #define o(mnemonic, opcode, test, op) if (test) { op; } else
-    INSTRUCTION_LIST(o) {}
+typedef struct Instruction {
+    const char* mnemonic;
+    const char* opcode;
+    Predicate   test;
+    Handler     exec;
+} Instruction;
+
+// One Instruction per INSTRUCTION_LIST entry, in list order, for quirk profile Q.
+// Each entry uses only some of the operands.
+template <typename Q>
+constexpr Instruction instructionSet[] = {
+    #define o(mnemonic, opcode, test, op) { mnemonic, opcode,\
+        [](unsigned u, [[maybe_unused]] unsigned x, [[maybe_unused]] unsigned y, [[maybe_unused]] unsigned n,\
+           [[maybe_unused]] unsigned kk, [[maybe_unused]] unsigned nnn) -> bool { return test; },\
+        []([[maybe_unused]] Chip8* vm, [[maybe_unused]] unsigned x, [[maybe_unused]] unsigned y,\
+           [[maybe_unused]] unsigned n, [[maybe_unused]] unsigned kk, [[maybe_unused]] unsigned nnn) { op; } },
+    INSTRUCTION_LIST(o)
     #undef o
+};
+
+// Names and predicates are the same in every profile
+constexpr auto&    instructions     = instructionSet<QuirksChip8>;
+constexpr unsigned instructionCount = sizeof(instructions) / sizeof(instructions[0]);
+
+constexpr bool samePattern (const char* a, const char* b) {
+    while (*a && *a == *b) a++, b++;
+    return *a == *b;
 }
 
-void initVM (Chip8* vm, const char* ROMfile) {
-    // Initialize PC to the 0x200 position in RAM
-    vm->PC = 0x200;
-    loadROM(ROMfile, vm);
+// INSTRUCTION_LIST index of the entry with opcode pattern `opcode`, such as "Dxyn"
+constexpr unsigned patternIndex (const char* opcode) {
+    for (unsigned i = 0; i < instructionCount; i++) {
+        if (samePattern(instructions[i].opcode, opcode)) return i;
+    }
+    return instructionCount;
 }
 
-int main(int argc, char** argv) {
-    Chip8* vm;
-    
-    // Load ROM, set up registers and Program Counter
-    initVM (vm, argv[1]);
-    
-    // Chip-8 Cycle
-    for(;;)
-    {
-        /************** Fetch *********************/
-        fetch (vm);
-        /************** Decode ********************/
-        decode (vm);
-        /************** Execute *******************/
+/*
+    Superinstructions
+    Pairs of instructions common enough in game loops to be worth a single
+    dispatch. predecode() gives the first slot of a matching pair a fused
+    handler running both; the second slot keeps its own plain decode for
+    jumps landing on it.
+*/
+#define FUSION_LIST(f)\
+    f("Annn", "Dxyn")/*Point I at a sprite and draw it*/\
+    f("6xkk", "6xkk")/*Load two registers*/\
+    f("3xkk", "1nnn")/*Loop until VX equals NN*/\
+    f("4xkk", "1nnn")/*Loop while VX equals NN*/\
+    f("7xkk", "3xkk")/*Step a counter, then compare it*/\
+    f("7xkk", "4xkk")\
+    f("7xkk", "5xy0")\
+    f("7xkk", "9xy0")
+
+typedef struct Fusion {
+    unsigned first, second;  // INSTRUCTION_LIST indices
+} Fusion;
+
+constexpr Fusion fusions[] = {
+    #define f(first, second) { patternIndex(first), patternIndex(second) },
+    FUSION_LIST(f)
+    #undef f
+};
+constexpr unsigned fusionCount = sizeof(fusions) / sizeof(fusions[0]);
+
+// Handler running fusions[fusion] under quirk profile Q, defined with the profiler hooks
+template <typename Q>
+Handler fusedHandler (unsigned fusion);
+
+// Unassigned encodings are executed as a no-op
+void illegal (Chip8*, unsigned, unsigned, unsigned, unsigned, unsigned) {}
+
+/*
+    Two level dispatch:
+    The top nibble (OP) selects a group. Groups 0x0, 0xE and 0xF are further
+    keyed by the low byte (NN), group 0x8 by the low nibble (N). Every other
+    group holds a single handler, so its key mask is 0 and it always hits slot 0.
+
+        handler = groups[u].handlers[instr & groups[u].mask]
+
+    A parallel set of tables maps each encoding to its INSTRUCTION_LIST index.
+*/
+typedef struct DispatchGroup {
+    unsigned       mask;
+    const Handler* handlers;
+    const uint8_t* indices;
+} DispatchGroup;
+
+typedef struct DispatchTable {
+    Handler       group0[256];
+    Handler       group8[16];
+    Handler       groupE[256];
+    Handler       groupF[256];
+    Handler       single[16];
+    uint8_t       index0[256];
+    uint8_t       index8[16];
+    uint8_t       indexE[256];
+    uint8_t       indexF[256];
+    uint8_t       indexSingle[16];
+    DispatchGroup groups[16];
+    Handler       fused[fusionCount];
+} DispatchTable;
+
+// Index of the first INSTRUCTION_LIST entry matching instr, mirroring the order of
+// the original if/else chain. instructionCount if nothing matches.
+unsigned find (char16_t instr) {
+    unsigned u   = (instr & OP) >> 12;
+    unsigned x   = (instr & Vx) >> 8;
+    unsigned y   = (instr & Vy) >> 4;
+    unsigned n   =  instr & N;
+    unsigned kk  =  instr & NN;
+    unsigned nnn =  instr & NNN;
+
+    for (unsigned i = 0; i < instructionCount; i++) {
+        if (instructions[i].test(u, x, y, n, kk, nnn)) return i;
+    }
+    return instructionCount;
+}
+
+template <typename Q = QuirksChip8>
+Handler lookup (char16_t instr) {
+    unsigned i = find(instr);
+    return i < instructionCount ? instructionSet<Q>[i].exec : illegal;
+}
+
+template <typename Q>
+DispatchTable buildDispatchTable () {
+    DispatchTable t = {};
+
+    for (unsigned u = 0; u < 16; u++) {
+        Handler* slots = t.single + u;
+        uint8_t* index = t.indexSingle + u;
+        unsigned mask  = 0x0000;
+
+        if (u == 0x0) { slots = t.group0; index = t.index0; mask = NN; }
+        if (u == 0x8) { slots = t.group8; index = t.index8; mask = N;  }
+        if (u == 0xE) { slots = t.groupE; index = t.indexE; mask = NN; }
+        if (u == 0xF) { slots = t.groupF; index = t.indexF; mask = NN; }
+
+        for (unsigned key = 0; key <= mask; key++) {
+            index[key] = find((u << 12) | key);
+            slots[key] = lookup<Q>((u << 12) | key);
+        }
+        t.groups[u].mask     = mask;
+        t.groups[u].handlers = slots;
+        t.groups[u].indices  = index;
+    }
+    for (unsigned f = 0; f < fusionCount; f++) {
+        t.fused[f] = fusedHandler<Q>(f);
+    }
+    return t;
+}
+
+template <typename Q>
+const DispatchTable dispatchFor = buildDispatchTable<Q>();
+
+const DispatchTable* defaultDispatch () {
+    return &dispatchFor<QuirksChip8>;
+}
+
+// INSTRUCTION_LIST index of instr, instructionCount for unassigned encodings
+unsigned opIndex (char16_t instr) {
+    const DispatchGroup& group = dispatchFor<QuirksChip8>.groups[(instr & OP) >> 12];
+    return group.indices[instr & group.mask];
+}
+
+// Stopped for good: on a jump to itself or on EXIT, which like the dispatch
+// tables takes any 0nFD
+bool halted (const Chip8* vm) {
+    unsigned pc    = vm->PC & 0xFFF;
+    unsigned instr = (vm->ram[pc] << 8) | vm->ram[(pc + 1) & 0xFFF];
+    return instr == (0x1000u | pc) || opIndex(instr) == patternIndex("00FD");
+}
+
+/*
+    Profiler
+    Built with -DCHIP8_PROFILE=1, every executed instruction is counted per
+    INSTRUCTION_LIST entry and per PC, and the number of instructions between
+    consecutive DRWs goes into a log2 histogram. Otherwise `profiling` is a
+    constant false and the hooks compile away entirely.
+*/
+#ifndef CHIP8_PROFILE
+#define CHIP8_PROFILE 0
+#endif
+constexpr bool profiling = CHIP8_PROFILE;
+
+typedef struct Profile {
+    uint64_t cycles   = 0;
+    uint64_t lastDraw = 0;
+    uint64_t ops[instructionCount + 1] = {};  // Last slot counts unassigned encodings
+    uint64_t pcHits[4096]              = {};
+    uint8_t  pcOp[4096]                = {};  // Entry last executed at each PC
+    uint64_t drawGaps[64]              = {};  // Bucket b holds gaps in [2^b, 2^(b+1))
+} Profile;
+
+inline void profileOp (Chip8* vm, unsigned pc, char16_t instr) {
+    Profile* p = vm->profile;
+    if (!p) return;
+
+    unsigned op  = opIndex(instr);
+    pc          &= 0xFFF;
+    p->ops[op]++;
+    p->pcHits[pc]++;
+    p->pcOp[pc]  = op;
+    p->cycles++;
+
+    if ((instr & OP) == 0xD000) {
+        uint64_t gap = p->cycles - p->lastDraw;
+        p->drawGaps[63 - __builtin_clzll(gap)]++;
+        p->lastDraw = p->cycles;
+    }
+}
+
+const char* profileName (unsigned op) {
+    return op < instructionCount ? instructions[op].mnemonic : "illegal";
+}
+
+// Write <prefix>.csv (kind,key,mnemonic,count rows) and <prefix>.folded
+// (flame graph stacks of mnemonic;PC)
+bool dumpProfile (const Profile* p, const char* prefix) {
+    string base(prefix);
+    FILE* csv    = fopen((base + ".csv").c_str(), "w");
+    FILE* folded = fopen((base + ".folded").c_str(), "w");
+    if (!csv || !folded) {
+        if (csv)    fclose(csv);
+        if (folded) fclose(folded);
+        return false;
+    }
+
+    fprintf(csv, "kind,key,mnemonic,count\n");
+    for (unsigned op = 0; op <= instructionCount; op++) {
+        if (!p->ops[op]) continue;
+        fprintf(csv, "op,%s,\"%s\",%llu\n", op < instructionCount ? instructions[op].opcode : "----",
+                profileName(op), (unsigned long long)p->ops[op]);
+    }
+    for (unsigned pc = 0; pc < 4096; pc++) {
+        if (!p->pcHits[pc]) continue;
+        fprintf(csv, "pc,0x%03X,\"%s\",%llu\n", pc, profileName(p->pcOp[pc]), (unsigned long long)p->pcHits[pc]);
+        fprintf(folded, "%s;0x%03X %llu\n", profileName(p->pcOp[pc]), pc, (unsigned long long)p->pcHits[pc]);
+    }
+    for (unsigned b = 0; b < 64; b++) {
+        if (!p->drawGaps[b]) continue;
+        fprintf(csv, "drw_gap,%llu,,%llu\n", 1ull << b, (unsigned long long)p->drawGaps[b]);
+    }
+    fclose(csv);
+    fclose(folded);
+    return true;
+}
+
+/*
+    Execution log
+    A full instruction trace for chasing divergence between backends, cheap
+    enough to leave on. Every hook the profiler has also copies the state the
+    instruction starts from into a fixed size record in a single producer ring:
+    plain stores and one release per record, no locks, no formatting. A drain
+    thread started by openLog() writes the raw records to a file and decodeLog()
+    (--decode) turns them into a listing offline, disassembling each
+    instruction through the INSTRUCTION_LIST mnemonics and diffing it against
+    the next record to show what it changed.
+
+    When the drain falls behind, a lossless log waits for it and any other log
+    drops records, which the decoder shows as a gap in the cycle count. Built
+    with -DCHIP8_LOG=0 the hooks compile away entirely.
+*/
+#ifndef CHIP8_LOG
+#define CHIP8_LOG 1
+#endif
+constexpr bool logging = CHIP8_LOG;
+
+#define LOG_RECORDS (1u << 16)  // Ring capacity, 2 MB
+#define LOG_VERSION 1
+
+// State before one instruction
+typedef struct alignas(32) LogRecord {
+    uint32_t cycle;   // Low bits of vm->cycles, counting this instruction
+    uint16_t pc;
+    uint16_t instr;
+    uint16_t I;
+    uint16_t keys;
+    uint8_t  SP;
+    uint8_t  dTimer;
+    uint8_t  sTimer;
+    uint8_t  spare;
+    uint8_t  V[16];
+} LogRecord;
+
+typedef struct ExecLog {
+    LogRecord        records[LOG_RECORDS];
+    bool             lossless = false;
+    uint64_t         limit    = LOG_RECORDS;   // Producer's view of tail + LOG_RECORDS
+    atomic<uint64_t> lost     { 0 };
+    alignas(64) atomic<uint64_t> head { 0 };   // Next record the VM writes
+    alignas(64) atomic<uint64_t> tail { 0 };   // Next record the drain reads
+    atomic<bool>     stopping { false };
+    FILE*            file     = nullptr;
+    thread           drain;
+} ExecLog;
+
+inline void logOp (Chip8* vm, unsigned pc, char16_t instr) {
+    ExecLog* log = vm->log;
+    if (!log) return;
+
+    uint64_t head = log->head.load(memory_order_relaxed);
+    if (head == log->limit) {
+        log->limit = log->tail.load(memory_order_acquire) + LOG_RECORDS;
+        while (head == log->limit && log->lossless) {
+            this_thread::yield();
+            log->limit = log->tail.load(memory_order_acquire) + LOG_RECORDS;
+        }
+        if (head == log->limit) {
+            log->lost.store(log->lost.load(memory_order_relaxed) + 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    LogRecord* r = &log->records[head % LOG_RECORDS];
+    r->cycle  = vm->cycles;
+    r->pc     = pc;
+    r->instr  = instr;
+    r->I      = vm->I;
+    r->keys   = vm->keys;
+    r->SP     = vm->SP;
+    r->dTimer = vm->dTimer;
+    r->sTimer = vm->sTimer;
+    memcpy(r->V, vm->V, sizeof(r->V));
+    log->head.store(head + 1, memory_order_release);
+}
+
+// Write everything from tail to head to the file, returns the number of records
+size_t drainLog (ExecLog* log) {
+    uint64_t tail = log->tail.load(memory_order_relaxed);
+    uint64_t head = log->head.load(memory_order_acquire);
+    for (uint64_t at = tail; at < head; ) {
+        uint64_t run = min<uint64_t>(head - at, LOG_RECORDS - at % LOG_RECORDS);
+        fwrite(&log->records[at % LOG_RECORDS], sizeof(LogRecord), run, log->file);
+        at += run;
+    }
+    log->tail.store(head, memory_order_release);
+    return head - tail;
+}
+
+// Start logging vm's instructions to filename
+bool openLog (Chip8* vm, const char* filename, bool lossless) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+    fwrite("C8XL", 1, 4, file);
+    fputc(LOG_VERSION, file);
+    fputc(sizeof(LogRecord), file);
+
+    ExecLog* log  = new ExecLog;
+    log->file     = file;
+    log->lossless = lossless;
+    log->drain    = thread([log] {
+        while (!log->stopping.load(memory_order_acquire)) {
+            if (!drainLog(log)) this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    });
+    vm->log = log;
+    return true;
+}
+
+// Stop logging, write what is left and close the file. Returns false when the
+// file could not be written. *lost receives the number of records dropped.
+bool closeLog (Chip8* vm, uint64_t* lost) {
+    ExecLog* log = vm->log;
+    if (!log) return true;
+    vm->log = nullptr;
+
+    log->stopping.store(true, memory_order_release);
+    log->drain.join();
+    drainLog(log);
+    if (lost) *lost = log->lost.load(memory_order_relaxed);
+    bool ok = !ferror(log->file);
+    ok &= fclose(log->file) == 0;
+    delete log;
+    return ok;
+}
+
+// instr in assembler syntax, its mnemonic with the operands filled in
+void disassemble (char* out, size_t size, char16_t instr) {
+    unsigned op = opIndex(instr);
+    if (op == instructionCount) {
+        snprintf(out, size, "DW 0x%04X", instr);
+        return;
+    }
+
+    unsigned x = (instr & Vx) >> 8, y = (instr & Vy) >> 4;
+    string   text;
+    char     field[8];
+    for (const char* p = instructions[op].mnemonic; *p; ) {
+        size_t word = strcspn(p, " ,{}");
+        string token(p, word);
+        if      (token == "Vx")     snprintf(field, sizeof(field), "V%X", x);
+        else if (token == "Vy")     snprintf(field, sizeof(field), "V%X", y);
+        else if (token == "byte")   snprintf(field, sizeof(field), "0x%02X", instr & NN);
+        else if (token == "addr")   snprintf(field, sizeof(field), "0x%03X", instr & NNN);
+        else if (token == "nibble") snprintf(field, sizeof(field), "%u", instr & N);
+        else if (token == "n")      snprintf(field, sizeof(field), "%u", x);  // PLANE n
+        else                        snprintf(field, sizeof(field), "%s", token.c_str());
+        text += field;
+        p    += word;
+        if (*p) text += *p++;
+    }
+    snprintf(out, size, "%s", text.c_str());
+}
+
+// Registers that differ between two records, as "VA=03 I=0x2F0" and so on
+string logChanges (const LogRecord* a, const LogRecord* b) {
+    string out;
+    char   field[16];
+    for (unsigned r = 0; r < 16; r++) {
+        if (a->V[r] == b->V[r]) continue;
+        snprintf(field, sizeof(field), " V%X=%02X", r, b->V[r]);
+        out += field;
+    }
+    if (a->I != b->I)           out += (snprintf(field, sizeof(field), " I=0x%03X", b->I), field);
+    if (a->SP != b->SP)         out += (snprintf(field, sizeof(field), " SP=%u", b->SP), field);
+    if (a->dTimer != b->dTimer) out += (snprintf(field, sizeof(field), " DT=%02X", b->dTimer), field);
+    if (a->sTimer != b->sTimer) out += (snprintf(field, sizeof(field), " ST=%02X", b->sTimer), field);
+    if (a->keys != b->keys)     out += (snprintf(field, sizeof(field), " keys=%04X", b->keys), field);
+    return out;
+}
+
+/*
+    A fused handler receives the first instruction's low 12 bits as nnn and the
+    second's operands as x, y, n and kk. The second instruction only runs if the
+    first left PC alone, so a taken skip still skips it. Each half is counted in
+    vm->cycles and the profile as if it had been dispatched on its own, and the
+    pair splits at vm->deadline.
+*/
+template <typename Q, unsigned A, unsigned B>
+void fused (Chip8* vm, unsigned x, unsigned y, unsigned n, unsigned kk, unsigned nnn) {
+    constexpr Handler first  = instructionSet<Q>[A].exec;
+    constexpr Handler second = instructionSet<Q>[B].exec;
+    constexpr unsigned group = instructions[B].opcode[0] <= '9' ? instructions[B].opcode[0] - '0'
+                                                                : instructions[B].opcode[0] - 'A' + 10;
+    unsigned pc = vm->PC;
+
+    first(vm, nnn >> 8, (nnn >> 4) & 0xF, nnn & 0xF, nnn & 0xFF, nnn);
+    if (vm->PC != pc || vm->cycles >= vm->deadline) return;
+
+    if constexpr (profiling) profileOp(vm, pc, (group << 12) | (x << 8) | kk);
+    vm->cycles++;
+    if constexpr (logging)   logOp(vm, pc, (group << 12) | (x << 8) | kk);
+    vm->PC += 2;
+    second(vm, x, y, n, kk, (x << 8) | kk);
+}
+
+template <typename Q, unsigned... F>
+Handler fusedHandler (unsigned fusion, integer_sequence<unsigned, F...>) {
+    constexpr Handler handlers[] = { fused<Q, fusions[F].first, fusions[F].second>... };
+    return handlers[fusion];
+}
+
+template <typename Q>
+Handler fusedHandler (unsigned fusion) {
+    return fusedHandler<Q>(fusion, make_integer_sequence<unsigned, fusionCount>());
+}
+
+// Decode current instruction, then execute instruction
+void decode (Chip8* vm) {
+    unsigned u   = (vm->instr & OP) >> 12; // u - First 4 bits of instruction
+    unsigned x   = (vm->instr & Vx) >> 8;  // x - A 4-bit value, the lower 4 bits of the high byte of the instruction
+    unsigned y   = (vm->instr & Vy) >> 4;  // y - A 4-bit value, the upper 4 bits of the low byte of the instruction
+    unsigned n   =  vm->instr & N;         // n or nibble - A 4-bit value, the lowest 4 bits of the instruction
+    unsigned kk  =  vm->instr & NN;        // kk or byte - An 8-bit value, the lowest 8 bits of the instruction
+    unsigned nnn =  vm->instr & NNN;       // nnn or addr - A 12-bit value, the lowest 12 bits of the instruction
+
+    if constexpr (profiling) profileOp(vm, vm->PC - 2, vm->instr);
+    if constexpr (logging)   logOp(vm, vm->PC - 2, vm->instr);
+
+    // Execute instruction based on opcode
+    const DispatchGroup& group = vm->dispatch->groups[u];
+    group.handlers[vm->instr & group.mask](vm, x, y, n, kk, nnn);
+}
+
+// Split instr into its operand fields and resolve its handler in table
+void predecode (Decoded* d, const DispatchTable* table, char16_t instr) {
+    d->instr = instr;
+    d->x     = (instr & Vx) >> 8;
+    d->y     = (instr & Vy) >> 4;
+    d->n     =  instr & N;
+    d->kk    =  instr & NN;
+    d->nnn   =  instr & NNN;
+    const DispatchGroup& group = table->groups[(instr & OP) >> 12];
+    d->exec  = group.handlers[instr & group.mask];
+}
+
+// predecode() instr, fusing it with the instruction after it where FUSION_LIST
+// has the pair. Returns the number of instructions the entry covers.
+unsigned predecodePair (Decoded* d, const DispatchTable* table, char16_t instr, char16_t next) {
+    predecode(d, table, instr);
+
+    unsigned first  = opIndex(instr);
+    unsigned second = opIndex(next);
+    for (unsigned f = 0; f < fusionCount; f++) {
+        if (fusions[f].first != first || fusions[f].second != second) continue;
+        d->exec = table->fused[f];
+        d->nnn  =  instr & NNN;
+        d->x    = (next & Vx) >> 8;
+        d->y    = (next & Vy) >> 4;
+        d->n    =  next & N;
+        d->kk   =  next & NN;
+        return 2;
+    }
+    return 1;
+}
+
+// PCs served by the pre-decoded cache and the recompiler
+bool cacheable (unsigned pc) {
+    return pc >= CACHE_BASE && !(pc & 1) && pc <= 0xFFE;
+}
+
+// Pre-decode ram[pc], fused with ram[pc + 2] when that is in the cache too
+unsigned predecodeAt (Chip8* vm, Decoded* d, unsigned pc) {
+    char16_t instr = (vm->ram[pc] << 8) | vm->ram[pc + 1];
+    if (!cacheable(pc + 2)) {
+        predecode(d, vm->dispatch, instr);
+        return 1;
+    }
+    return predecodePair(d, vm->dispatch, instr, (vm->ram[pc + 2] << 8) | vm->ram[pc + 3]);
+}
+
+// Fetch, decode and execute one instruction, or a fused pair, through the
+// pre-decoded cache. Odd or out of range PCs fall back to fetch() and decode().
+// Only that fallback updates vm->instr.
+void step (Chip8* vm) {
+    unsigned pc = vm->PC;
+
+    vm->cycles++;
+    if (!cacheable(pc)) {
+        fetch(vm);
+        decode(vm);
+        return;
+    }
+
+    Decoded& d = vm->decoded[(pc - CACHE_BASE) >> 1];
+    if (!d.exec) predecodeAt(vm, &d, pc);
+
+    // instr is left alone: storing it here merges with the PC store and puts
+    // the cache load on the PC dependency chain of the next step
+    if constexpr (profiling) profileOp(vm, pc, d.instr);
+    if constexpr (logging)   logOp(vm, pc, d.instr);
+    vm->PC += 2;
+    d.exec(vm, d.x, d.y, d.n, d.kk, d.nnn);
+}
+
+/*
+    Block recompiler
+    Straight-line runs of instructions are translated once into a block: a flat
+    array of handlers with their operands bound, run back to back with no fetch,
+    decode or table lookup in between. A block ends at the first instruction that
+    can change control flow (1nnn, 2nnn, 00EE, Bnnn, the skips, Fx0A) or write to
+    ram (Fx33, Fx55), so writes into code are always seen before the next block.
+
+    Blocks are cached by their start PC. `code` counts how many blocks cover each
+    instruction slot so writes to plain data never touch the block cache.
+*/
+typedef struct Block {
+    uint16_t        start;  // First byte of the block
+    uint16_t        end;    // One past the last byte of the block
+    vector<Decoded> ops;
+} Block;
+
+typedef struct Recompiler {
+    Block*  blocks[CACHE_SIZE] = {};
+    uint8_t code[CACHE_SIZE]   = {};
+} Recompiler;
+
+// Instructions after which a block must hand control back to runBlock()
+bool endsBlock (char16_t instr) {
+    unsigned u  = (instr & OP) >> 12;
+    unsigned kk =  instr & NN;
+
+    switch (u) {
+        case 0x0: return kk == 0xEE || kk == 0xFD;
+        case 0x1: case 0x2: case 0x3: case 0x4:
+        case 0x5: case 0x9: case 0xB: case 0xE: return true;
+        case 0xF: return kk == 0x0A || kk == 0x33 || kk == 0x55;
+        default:  return false;
+    }
+}
+
+Block* recompile (Recompiler* jit, Chip8* vm, unsigned pc) {
+    Block* block = new Block;
+    block->start = pc;
+
+    for (;;) {
+        Decoded  d;
+        unsigned covered = predecodeAt(vm, &d, pc);
+        char16_t last    = (vm->ram[pc + 2 * covered - 2] << 8) | vm->ram[pc + 2 * covered - 1];
+        block->ops.push_back(d);
+        for (unsigned i = 0; i < covered; i++, pc += 2) {
+            jit->code[(pc - CACHE_BASE) >> 1]++;
+        }
+        if (endsBlock(d.instr) || endsBlock(last) || !cacheable(pc)) break;
+    }
+    block->end = pc;
+    jit->blocks[(block->start - CACHE_BASE) >> 1] = block;
+    return block;
+}
+
+void freeBlock (Recompiler* jit, unsigned slot) {
+    Block* block = jit->blocks[slot];
+    for (unsigned a = block->start; a < block->end; a += 2) {
+        jit->code[(a - CACHE_BASE) >> 1]--;
+    }
+    jit->blocks[slot] = nullptr;
+    delete block;
+}
+
+// Drop every block overlapping ram[addr .. end)
+void recompilerInvalidate (Recompiler* jit, unsigned addr, unsigned end) {
+    bool hit = false;
+    for (unsigned a = addr & ~1u; a < end; a += 2) {
+        hit |= jit->code[(a - CACHE_BASE) >> 1] != 0;
+    }
+    if (!hit) return;
+
+    for (unsigned slot = 0; slot < CACHE_SIZE; slot++) {
+        Block* block = jit->blocks[slot];
+        if (block && block->start < end && addr < block->end) freeBlock(jit, slot);
+    }
+}
+
+void attachRecompiler (Chip8* vm) {
+    if (!vm->jit) vm->jit = new Recompiler;
+}
+
+void detachRecompiler (Chip8* vm) {
+    if (!vm->jit) return;
+    for (unsigned slot = 0; slot < CACHE_SIZE; slot++) {
+        if (vm->jit->blocks[slot]) freeBlock(vm->jit, slot);
+    }
+    delete vm->jit;
+    vm->jit = nullptr;
+}
+
+// A block, or a step, ran `count` instructions in a row from pc
+inline void countHits (uint32_t* hits, unsigned pc, unsigned count) {
+    for (unsigned i = 0; i < count; i++) hits[((pc >> 1) + i) & 2047]++;
+}
+
+// Execute the block starting at PC, compiling it first if needed. Returns the
+// number of instructions executed. Like step() it stops at vm->deadline, so it
+// is interchangeable with step() on the same state and budget.
+unsigned runBlock (Chip8* vm) {
+    unsigned pc     = vm->PC;
+    uint64_t cycles = vm->cycles;
+
+    if (!vm->jit || !cacheable(pc)) {
+        step(vm);
+        if (vm->hits) countHits(vm->hits, pc, vm->cycles - cycles);
+        return vm->cycles - cycles;
+    }
+
+    Block* block = vm->jit->blocks[(pc - CACHE_BASE) >> 1];
+    if (!block) block = recompile(vm->jit, vm, pc);
+
+    // The last op may write into this very block and free it, so nothing
+    // reads from block once the final handler has been called
+    const Decoded* op = block->ops.data();
+    unsigned count    = block->ops.size();
+    for (unsigned i = 0; i < count; i++, op++) {
+        if constexpr (profiling) profileOp(vm, vm->PC, op->instr);
+        vm->cycles++;
+        if constexpr (logging)   logOp(vm, vm->PC, op->instr);
+        vm->PC += 2;
+        op->exec(vm, op->x, op->y, op->n, op->kk, op->nnn);
+        if (vm->cycles >= vm->deadline) break;
+    }
+    if (vm->hits) countHits(vm->hits, pc, vm->cycles - cycles);
+    return vm->cycles - cycles;
+}
+
+/*
+    Static analysis
+    analyzeROM() walks every path from 0x200 through the decode tables without
+    running anything, marking reachable instructions and splitting them into
+    basic blocks. I is followed along each path while it holds an Annn constant,
+    which is enough to tell the sprites and save areas of most ROMs apart from
+    their code. What the walk can't follow is flagged instead: Bnnn jumps, and
+    Fx33/Fx55 writes through an unknown I or over reachable code.
+*/
+#define MAP_INSTR    0x001  // First byte of a reachable instruction
+#define MAP_CODE     0x002  // Either byte of a reachable instruction
+#define MAP_LEADER   0x004  // Starts a basic block
+#define MAP_CALL     0x008  // Target of a 2nnn
+#define MAP_SPRITE   0x010  // Drawn by a Dxyn with a known I
+#define MAP_LOADED   0x020  // Read by an Fx65 with a known I
+#define MAP_STORED   0x040  // Written by an Fx33 or Fx55 with a known I
+#define MAP_INDIRECT 0x080  // Bnnn, its target depends on the registers
+#define MAP_WILD     0x100  // Fx33 or Fx55 with an unknown I
+#define MAP_SELFMOD  0x200  // Fx33 or Fx55 writing over reachable code
+
+// I not known to the walk
+#define MAP_UNKNOWN 0xFFFFu
+
+typedef struct MapBlock {
+    uint16_t start, end;  // ram[start .. end)
+    uint16_t next[2];     // Successors, jump or skip target first
+    uint8_t  nexts;
+} MapBlock;
+
+// An Fx33 or Fx55 with a known I
+typedef struct MapStore {
+    uint16_t pc, addr, len;
+} MapStore;
+
+typedef struct ROMMap {
+    uint16_t         flags[4096] = {};
+    vector<MapBlock> blocks;  // In address order
+    vector<MapStore> stores;  // In walk order
+} ROMMap;
+
+// Addresses control can reach from the instruction at pc, at most two. 00EE,
+// 00FD and Bnnn have none the walk can follow. Returns false for instructions
+// that always fall through to pc + 2.
+bool branches (char16_t instr, unsigned pc, unsigned next[2], unsigned* nexts) {
+    switch (opIndex(instr)) {
+        case patternIndex("00EE"): case patternIndex("00FD"): case patternIndex("Bnnn"):
+            *nexts = 0;
+            return true;
+        case patternIndex("1nnn"):
+            next[0] = instr & NNN;
+            *nexts  = 1;
+            return true;
+        case patternIndex("2nnn"):
+            next[0] = instr & NNN;
+            next[1] = pc + 2;
+            *nexts  = 2;
+            return true;
+        case patternIndex("3xkk"): case patternIndex("4xkk"): case patternIndex("5xy0"):
+        case patternIndex("9xy0"): case patternIndex("Ex9E"): case patternIndex("ExA1"):
+            next[0] = pc + 4;
+            next[1] = pc + 2;
+            *nexts  = 2;
+            return true;
+        default:
+            next[0] = pc + 2;
+            *nexts  = 1;
+            return false;
+    }
+}
+
+void markRange (ROMMap* map, unsigned addr, unsigned len, uint16_t flag) {
+    for (unsigned i = 0; i < len; i++) map->flags[(addr + i) & 0xFFF] |= flag;
+}
+
+// Follow I through the instruction at pc, marking the bytes it reads or writes.
+// Returns I as seen by the next instruction.
+unsigned trackI (ROMMap* map, const uint8_t* ram, unsigned pc, unsigned I) {
+    char16_t instr = (ram[pc] << 8) | ram[pc + 1];
+    unsigned x     = (instr & Vx) >> 8;
+    unsigned n     =  instr & N;
+
+    switch (opIndex(instr)) {
+        case patternIndex("Annn"): return instr & NNN;
+        case patternIndex("Dxyn"):
+            if (I != MAP_UNKNOWN) markRange(map, I, n ? n : 32, MAP_SPRITE);
+            return I;
+        case patternIndex("Fx65"):
+            if (I != MAP_UNKNOWN) markRange(map, I, x + 1, MAP_LOADED);
+            return MAP_UNKNOWN;
+        case patternIndex("Fx33"): case patternIndex("Fx55"): {
+            unsigned len = opIndex(instr) == patternIndex("Fx33") ? 3 : x + 1;
+            if (I == MAP_UNKNOWN) {
+                map->flags[pc] |= MAP_WILD;
+            } else {
+                markRange(map, I, len, MAP_STORED);
+                map->stores.push_back({ (uint16_t)pc, (uint16_t)I, (uint16_t)len });
+            }
+            return opIndex(instr) == patternIndex("Fx33") ? I : MAP_UNKNOWN;
+        }
+        case patternIndex("2nnn"): case patternIndex("Fx1E"): case patternIndex("Fx29"):
+            return MAP_UNKNOWN;
+        default:
+            return I;
+    }
+}
+
+void analyzeROM (const uint8_t* ram, ROMMap* map) {
+    *map = ROMMap();
+
+    // Depth first, each instruction walked once with the I of its first visit
+    vector<pair<uint16_t, uint16_t>> work = { { 0x200, MAP_UNKNOWN } };
+    map->flags[0x200] |= MAP_LEADER;
+    while (!work.empty()) {
+        unsigned pc = work.back().first;
+        unsigned I  = work.back().second;
+        work.pop_back();
+        if (pc > 0xFFE || (map->flags[pc] & MAP_INSTR)) continue;
+
+        char16_t instr = (ram[pc] << 8) | ram[pc + 1];
+        map->flags[pc]     |= MAP_INSTR | MAP_CODE;
+        map->flags[pc + 1] |= MAP_CODE;
+        I = trackI(map, ram, pc, I);
+
+        unsigned next[2], nexts;
+        bool     branch = branches(instr, pc, next, &nexts);
+        if ((instr & OP) == 0x2000) map->flags[next[0]] |= MAP_CALL;
+        if ((instr & OP) == 0xB000) map->flags[pc]      |= MAP_INDIRECT;
+        for (unsigned i = nexts; i-- > 0; ) {
+            if (next[i] > 0xFFE) continue;
+            if (branch) map->flags[next[i]] |= MAP_LEADER;
+            work.push_back({ (uint16_t)next[i], (uint16_t)I });
+        }
+    }
+
+    // Stores whose target holds reachable code
+    for (const MapStore& store : map->stores) {
+        for (unsigned i = 0; i < store.len; i++) {
+            if (map->flags[(store.addr + i) & 0xFFF] & MAP_CODE) map->flags[store.pc] |= MAP_SELFMOD;
+        }
+    }
+
+    // A block runs from a leader up to its first branch or the next leader
+    for (unsigned start = 0x200; start <= 0xFFE; start++) {
+        if ((map->flags[start] & (MAP_LEADER | MAP_INSTR)) != (MAP_LEADER | MAP_INSTR)) continue;
+
+        MapBlock block = { (uint16_t)start, 0, { 0, 0 }, 0 };
+        for (unsigned pc = start; ; pc += 2) {
+            unsigned next[2], nexts;
+            bool     branch = branches((ram[pc] << 8) | ram[pc + 1], pc, next, &nexts);
+            bool     last   = branch || pc + 2 > 0xFFE || (map->flags[pc + 2] & MAP_LEADER) ||
+                              !(map->flags[pc + 2] & MAP_INSTR);
+            if (!last) continue;
+
+            block.end = pc + 2;
+            for (unsigned i = 0; i < nexts; i++) {
+                if (next[i] <= 0xFFE) block.next[block.nexts++] = next[i];
+            }
+            break;
+        }
+        map->blocks.push_back(block);
+    }
+}
+
+// Pre-decode every reachable instruction and, with a recompiler attached,
+// translate every block of map, so none of it is decoded on first execution
+void precompile (Chip8* vm, const ROMMap* map) {
+    for (unsigned pc = CACHE_BASE; pc <= 0xFFE; pc += 2) {
+        Decoded& d = vm->decoded[(pc - CACHE_BASE) >> 1];
+        if ((map->flags[pc] & MAP_INSTR) && !d.exec) predecodeAt(vm, &d, pc);
+    }
+    if (!vm->jit) return;
+    for (const MapBlock& block : map->blocks) {
+        if (cacheable(block.start) && !vm->jit->blocks[(block.start - CACHE_BASE) >> 1]) {
+            recompile(vm->jit, vm, block.start);
+        }
+    }
+}
+
+// Analyze the program in vm's ram and precompile() it
+void precompileROM (Chip8* vm) {
+    ROMMap* map = new ROMMap;
+    analyzeROM(vm->ram, map);
+    precompile(vm, map);
+    delete map;
+}
+
+// Print each run of bytes carrying flag
+void printRanges (const ROMMap* map, uint16_t flag, const char* name) {
+    for (unsigned a = 0; a < 4096; a++) {
+        if (!(map->flags[a] & flag)) continue;
+        unsigned start = a;
+        while (a + 1 < 4096 && (map->flags[a + 1] & flag)) a++;
+        printf("%-7s %03X-%03X%s\n", name, start, a, (map->flags[start] & MAP_CODE) ? "  (code)" : "");
+    }
+}
+
+// Block listing, data ranges and a summary line for map
+void printAnalysis (const uint8_t* ram, const ROMMap* map) {
+    unsigned code = 0, data = 0, indirect = 0, wild = 0, selfmod = 0;
+    for (unsigned a = 0; a < 4096; a++) {
+        uint16_t f = map->flags[a];
+        code     += (f & MAP_CODE) != 0;
+        data     += !(f & MAP_CODE) && (f & (MAP_SPRITE | MAP_LOADED | MAP_STORED));
+        indirect += (f & MAP_INDIRECT) != 0;
+        wild     += (f & MAP_WILD) != 0;
+        selfmod  += (f & MAP_SELFMOD) != 0;
+    }
+
+    for (const MapBlock& block : map->blocks) {
+        printf("block   %03X-%03X", block.start, block.end - 1);
+        if (block.nexts) printf(" ->");
+        for (unsigned i = 0; i < block.nexts; i++) printf(" %03X", block.next[i]);
+        printf("%s\n", (map->flags[block.start] & MAP_CALL) ? "  (subroutine)" : "");
+
+        for (unsigned pc = block.start; pc < block.end; pc += 2) {
+            char16_t instr = (ram[pc] << 8) | ram[pc + 1];
+            uint16_t f     = map->flags[pc];
+            printf("    %03X  %04X  %s", pc, instr, profileName(opIndex(instr)));
+            if (f & MAP_INDIRECT) printf("  ; indirect jump");
+            if (f & MAP_WILD)     printf("  ; stores through an unknown I");
+            if (f & MAP_SELFMOD)  printf("  ; writes code");
+            printf("\n");
+        }
+    }
+    printRanges(map, MAP_SPRITE, "sprite");
+    printRanges(map, MAP_LOADED, "loaded");
+    printRanges(map, MAP_STORED, "stored");
+    printf("%zu blocks, %u code bytes, %u data bytes, %u indirect jumps, %u unknown stores, %u self-modifying stores\n",
+           map->blocks.size(), code, data, indirect, wild, selfmod);
+}
+
+// Power on a new VM, fontset and registers from powerOn and the ROM at 0x200
+bool initVM (Chip8* vm, const char* ROMfile) {
+    return reset(vm, ROMfile);
+}
+
+typedef enum QuirkProfile {
+    QUIRKS_CHIP8,
+    QUIRKS_SCHIP,
+    QUIRKS_XOCHIP,
+} QuirkProfile;
+
+bool parseQuirks (const char* name, QuirkProfile* profile) {
+    if      (strcmp(name, "chip8")  == 0) *profile = QUIRKS_CHIP8;
+    else if (strcmp(name, "schip")  == 0) *profile = QUIRKS_SCHIP;
+    else if (strcmp(name, "xochip") == 0) *profile = QUIRKS_XOCHIP;
+    else return false;
+    return true;
+}
+
+// Switch the VM to another profile's handlers, dropping everything decoded so far
+void useQuirks (Chip8* vm, QuirkProfile profile) {
+    switch (profile) {
+        case QUIRKS_CHIP8:  vm->dispatch = &dispatchFor<QuirksChip8>;  break;
+        case QUIRKS_SCHIP:  vm->dispatch = &dispatchFor<QuirksSchip>;  break;
+        case QUIRKS_XOCHIP: vm->dispatch = &dispatchFor<QuirksXOChip>; break;
+    }
+    for (unsigned i = 0; i < CACHE_SIZE; i++) {
+        vm->decoded[i].exec = nullptr;
+    }
+    if (vm->jit) recompilerInvalidate(vm->jit, CACHE_BASE, 4096);
+}
+
+/*
+    Snapshots
+    A Snapshot is a full copy of the architectural state. Taking one clears the
+    VM's dirty page mask and ties the VM to the snapshot id, so restoring that same
+    snapshot only copies back the 256 byte ram pages written since. Restoring any
+    other snapshot compares every page and copies back the span that differs, so
+    decoded and translated code outside it survives.
+
+    Serialized layout (little endian), version 3:
+        "C8SS" u8 version | ram[4096] | display rows u64[2][64][2] | hires u8
+        | planes u8 | V[16] | I u16 | PC u16 | SP u8 | stack u16[16] | dTimer u8
+        | sTimer u8 | rng state u64[4][4] | rng pool[256] | rng at u16
+*/
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BYTES   (5 + 4096 + PLANES * 64 * 2 * 8 + 1 + 1 + 16 + 2 + 2 + 1 + 16 * 2 + 1 + 1 \
+                          + 4 * RANDOM_STREAMS * 8 + RANDOM_POOL + 2)
+
+typedef struct Snapshot {
+    uint64_t id;
+    uint8_t  ram[4096];
+    Display  display;
+    uint8_t  V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t  SP;
+    uint16_t stack[16];
+    uint8_t  dTimer;
+    uint8_t  sTimer;
+    Random   rng;
+} Snapshot;
+
+void takeSnapshot (const Chip8* vm, Snapshot* snap) {
+    static atomic<uint64_t> ids(1);
+
+    snap->id = ids++;
+    memcpy(snap->ram, vm->ram, sizeof(snap->ram));
+    snap->display       = vm->display;
+    snap->display.dirty = 0;
+    memcpy(snap->V, vm->V, sizeof(snap->V));
+    memcpy(snap->stack, vm->stack, sizeof(snap->stack));
+    snap->I      = vm->I;
+    snap->PC     = vm->PC;
+    snap->SP     = vm->SP;
+    snap->dTimer = vm->dTimer;
+    snap->sTimer = vm->sTimer;
+    snap->rng    = vm->rng;
+}
+
+// Snapshot and start tracking writes relative to it
+void checkpoint (Chip8* vm, Snapshot* snap) {
+    takeSnapshot(vm, snap);
+    vm->base       = snap->id;
+    vm->dirtyPages = 0;
+}
+
+void restoreSnapshot (Chip8* vm, const Snapshot* snap) {
+    uint16_t pages = vm->base == snap->id ? vm->dirtyPages : 0xFFFF;
+
+    restoreRAM(vm, snap->ram, pages);
+    uint64_t dirty = vm->display.dirty;
+    for (unsigned y = 0; y < 64; y++) {
+        for (unsigned p = 0; p < PLANES; p++) {
+            if (memcmp(vm->display.rows[p][y], snap->display.rows[p][y], sizeof(snap->display.rows[p][y]))) dirty |= 1ull << y;
+        }
+    }
+    vm->display       = snap->display;
+    vm->display.dirty = dirty;
+    memcpy(vm->V, snap->V, sizeof(vm->V));
+    memcpy(vm->stack, snap->stack, sizeof(vm->stack));
+    vm->I          = snap->I;
+    vm->PC         = snap->PC;
+    vm->SP         = snap->SP;
+    vm->dTimer     = snap->dTimer;
+    vm->sTimer     = snap->sTimer;
+    vm->rng        = snap->rng;
+    vm->base       = snap->id;
+    vm->dirtyPages = 0;
+}
+
+// Write snap into out[SNAPSHOT_BYTES], returns the number of bytes written
+size_t saveSnapshot (const Snapshot* snap, uint8_t* out) {
+    uint8_t* p = out;
+    auto u16 = [&p](uint16_t v) { *p++ = v; *p++ = v >> 8; };
+
+    memcpy(p, "C8SS", 4); p += 4;
+    *p++ = SNAPSHOT_VERSION;
+    memcpy(p, snap->ram, 4096); p += 4096;
+    const uint64_t* rows = &snap->display.rows[0][0][0];
+    for (unsigned i = 0; i < PLANES * 64 * 2; i++) {
+        for (unsigned b = 0; b < 8; b++) *p++ = rows[i] >> (8 * b);
+    }
+    *p++ = snap->display.hires;
+    *p++ = snap->display.planes;
+    memcpy(p, snap->V, 16); p += 16;
+    u16(snap->I);
+    u16(snap->PC);
+    *p++ = snap->SP;
+    for (unsigned i = 0; i < 16; i++) u16(snap->stack[i]);
+    *p++ = snap->dTimer;
+    *p++ = snap->sTimer;
+    const uint64_t* words = &snap->rng.s[0][0];
+    for (unsigned i = 0; i < 4 * RANDOM_STREAMS; i++) {
+        for (unsigned b = 0; b < 8; b++) *p++ = words[i] >> (8 * b);
+    }
+    memcpy(p, snap->rng.pool, RANDOM_POOL); p += RANDOM_POOL;
+    u16(snap->rng.at);
+    return p - out;
+}
+
+// Parse a serialized snapshot, rejecting foreign or truncated data. The result
+// gets a fresh id, so the first restore from it is a full copy.
+bool loadSnapshot (const uint8_t* in, size_t size, Snapshot* snap) {
+    static atomic<uint64_t> ids(1ull << 63);
+    const uint8_t* p = in;
+    auto u16 = [&p]() { uint16_t v = p[0] | (p[1] << 8); p += 2; return v; };
+
+    if (size < SNAPSHOT_BYTES || memcmp(p, "C8SS", 4) != 0 || p[4] != SNAPSHOT_VERSION) return false;
+    p += 5;
+
+    snap->id = ids++;
+    memcpy(snap->ram, p, 4096); p += 4096;
+    snap->display = Display();
+    uint64_t* rows = &snap->display.rows[0][0][0];
+    for (unsigned i = 0; i < PLANES * 64 * 2; i++) {
+        for (unsigned b = 0; b < 8; b++) rows[i] |= (uint64_t)*p++ << (8 * b);
+    }
+    snap->display.hires  = *p++ != 0;
+    snap->display.planes = *p++ & 3;
+    memcpy(snap->V, p, 16); p += 16;
+    snap->I  = u16();
+    snap->PC = u16();
+    snap->SP = *p++;
+    for (unsigned i = 0; i < 16; i++) snap->stack[i] = u16();
+    snap->dTimer = *p++;
+    snap->sTimer = *p++;
+    snap->rng = Random();
+    uint64_t* words = &snap->rng.s[0][0];
+    for (unsigned i = 0; i < 4 * RANDOM_STREAMS; i++) {
+        for (unsigned b = 0; b < 8; b++) words[i] |= (uint64_t)*p++ << (8 * b);
+    }
+    memcpy(snap->rng.pool, p, RANDOM_POOL); p += RANDOM_POOL;
+    snap->rng.at = u16();
+    return snap->rng.at <= RANDOM_POOL;
+}
+
+/*
+    Keypad
+    Key events cross from the input thread to the VM's thread through a single
+    producer / single consumer ring: the producer only writes `head`, the
+    consumer only writes `tail`. drainKeys() folds the pending events into the
+    VM's 16-bit key mask once per tick. A press and release within one tick
+    still count as a press for Fx0A.
+
+    A VM waiting on Fx0A parks on the condition variable until the next tick is
+    due or a key arrives, whichever comes first. The producer only takes the
+    lock when the consumer is parked, so pushing a key is normally two atomic
+    stores.
+*/
+#define KEY_QUEUE 64
+#define KEY_DOWN  0x10   // Set in an event for a press, clear for a release
+
+typedef struct Keypad {
+    uint8_t            events[KEY_QUEUE];   // Key in the low nibble, plus KEY_DOWN
+    atomic<uint32_t>   head   { 0 };        // Next event the producer writes
+    atomic<uint32_t>   tail   { 0 };        // Next event the consumer reads
+    atomic<bool>       parked { false };
+    mutex              lock;
+    condition_variable wake;
+} Keypad;
+
+// Input thread: queue a key change, false if the ring is full and it was dropped
+bool pushKey (Keypad* pad, unsigned key, bool down) {
+    uint32_t head = pad->head.load(memory_order_relaxed);
+    if (head - pad->tail.load(memory_order_acquire) == KEY_QUEUE) return false;
+
+    pad->events[head % KEY_QUEUE] = (key & 0xF) | (down ? KEY_DOWN : 0);
+    pad->head.store(head + 1, memory_order_seq_cst);
+    if (pad->parked.load(memory_order_seq_cst)) {
+        lock_guard<mutex> guard(pad->lock);
+        pad->wake.notify_one();
+    }
+    return true;
+}
+
+void traceKey (Chip8* vm, unsigned key, bool down);
+
+// VM thread: apply every queued event to vm->keys, noting presses in vm->pressed
+void drainKeys (Chip8* vm) {
+    Keypad*  pad  = vm->keypad;
+    uint32_t tail = pad->tail.load(memory_order_relaxed);
+    uint32_t head = pad->head.load(memory_order_acquire);
+
+    vm->pressed = 0;
+    for (; tail != head; tail++) {
+        uint8_t  event = pad->events[tail % KEY_QUEUE];
+        uint16_t bit   = 1u << (event & 0xF);
+        if (vm->trace) traceKey(vm, event & 0xF, event & KEY_DOWN);
+        if (event & KEY_DOWN) {
+            vm->keys    |= bit;
+            vm->pressed |= bit;
+        } else {
+            vm->keys &= ~bit;
+        }
+    }
+    pad->tail.store(tail, memory_order_release);
+}
+
+// VM thread: sleep until `deadline` or until an event is queued, returns true
+// for an event
+bool parkKeypad (Keypad* pad, chrono::steady_clock::time_point deadline) {
+    unique_lock<mutex> guard(pad->lock);
+    pad->parked.store(true, memory_order_seq_cst);
+    bool ready = pad->wake.wait_until(guard, deadline, [pad] {
+        return pad->head.load(memory_order_seq_cst) != pad->tail.load(memory_order_relaxed);
+    });
+    pad->parked.store(false, memory_order_relaxed);
+    return ready;
+}
+
+/*
+    Input traces
+    A trace holds everything from outside the VM that a run depends on: each key
+    change as the VM took it in and each Cxkk draw, stamped with the tick and
+    cycle it happened on, plus a WAKE wherever a key resumed a parked VM between
+    ticks, on what was left of that tick's ipf. Replaying one against the same ROM and settings reproduces the run
+    bit for bit, at any speed.
+
+    On disk, after a header of "C8TR", the version, ipf, the quirk profile and a
+    hash of program space, every event is a LEB128 varint with its position
+    delta coded against the previous event:
+
+        (ticks  << 3) | TRACE_TICK                  later events are `ticks` on
+        (cycles << 7) | (key << 3) | TRACE_DOWN     key pressed
+        (cycles << 7) | (key << 3) | TRACE_UP       key released
+        (cycles << 3) | TRACE_RND, byte             Cxkk drew `byte`, before masking
+        (cycles << 3) | TRACE_WAKE                  a key resumed the parked VM
+        (ticks  << 3) | TRACE_END                   the session lasted `ticks` more
+
+    so a key change or a draw mostly takes two or three bytes.
+*/
+#define TRACE_VERSION 2   // 2: a WAKE no longer starts a fresh ipf
+#define TRACE_TICK    0
+#define TRACE_DOWN    1
+#define TRACE_UP      2
+#define TRACE_RND     3
+#define TRACE_WAKE    4
+#define TRACE_END     5
+
+typedef struct TraceEvent {
+    uint64_t tick;
+    uint64_t cycle;
+    uint8_t  type;
+    uint8_t  value;     // Key for TRACE_DOWN / TRACE_UP, the draw for TRACE_RND
+} TraceEvent;
+
+typedef struct Trace {
+    bool               replay   = false;
+    unsigned           ipf      = 11;
+    QuirkProfile       quirks   = QUIRKS_CHIP8;
+    uint64_t           program  = 0;        // programHash() when the run started
+    uint64_t           ticks    = 0;        // Length of the session
+    uint64_t           now      = 0;        // Tick being run, kept up by runInstructions()
+    vector<TraceEvent> events;
+    size_t             next     = 0;        // Replay: next event to apply
+    bool               diverged = false;    // Replay: an event didn't turn up where recorded
+} Trace;
+
+// FNV-1a over 0x200 -- 0xFFF, to tell whether a trace belongs to the loaded ROM
+uint64_t programHash (const Chip8* vm) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned a = 0x200; a < 4096; a++) {
+        hash = (hash ^ vm->ram[a]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+void traceEvent (Trace* trace, uint64_t cycle, uint8_t type, uint8_t value) {
+    trace->events.push_back({ trace->now, cycle, type, value });
+}
+
+void traceKey (Chip8* vm, unsigned key, bool down) {
+    traceEvent(vm->trace, vm->cycles, down ? TRACE_DOWN : TRACE_UP, key);
+}
+
+// Next event if it is of `type` and due at the VM's current position
+const TraceEvent* dueEvent (Chip8* vm, uint8_t type) {
+    Trace* trace = vm->trace;
+    if (trace->next >= trace->events.size()) return nullptr;
+
+    const TraceEvent* e = &trace->events[trace->next];
+    if (e->type != type || e->tick != trace->now || e->cycle != vm->cycles) return nullptr;
+    return e;
+}
+
+// Replay counterpart of drainKeys(): apply the key changes recorded here
+void replayKeys (Chip8* vm) {
+    Trace* trace = vm->trace;
+    vm->pressed = 0;
+    for (;;) {
+        const TraceEvent* e = dueEvent(vm, TRACE_DOWN);
+        if (!e) e = dueEvent(vm, TRACE_UP);
+        if (!e) break;
+
+        uint16_t bit = 1u << e->value;
+        if (e->type == TRACE_DOWN) {
+            vm->keys    |= bit;
+            vm->pressed |= bit;
+        } else {
+            vm->keys &= ~bit;
+        }
+        trace->next++;
+    }
+
+    // Anything left behind from an earlier position means the run has gone its own way
+    if (trace->next < trace->events.size()) {
+        const TraceEvent* e = &trace->events[trace->next];
+        if (e->tick < trace->now || (e->tick == trace->now && e->cycle < vm->cycles)) trace->diverged = true;
+    }
+}
+
+// Replay: consume a WAKE due before tick `tick`, true if the VM should run on
+bool replayWake (Chip8* vm, uint64_t tick) {
+    if (!vm->trace || !vm->trace->replay) return false;
+    vm->trace->now = tick;
+    if (!dueEvent(vm, TRACE_WAKE)) return false;
+    vm->trace->next++;
+    return true;
+}
+
+// Cxkk -- the next random byte, from the trace when replaying one
+uint8_t randomByte (Chip8* vm) {
+    Trace* trace = vm->trace;
+    if (trace && trace->replay) {
+        const TraceEvent* e = dueEvent(vm, TRACE_RND);
+        if (e) {
+            trace->next++;
+            return e->value;
+        }
+        trace->diverged = true;
+    }
+
+    uint8_t value = nextRandom(&vm->rng);
+    if (trace && !trace->replay) traceEvent(trace, vm->cycles, TRACE_RND, value);
+    return value;
+}
+
+void putVarint (FILE* file, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) fputc((v & 0x7F) | 0x80, file);
+    fputc(v, file);
+}
+
+bool getVarint (const uint8_t** p, const uint8_t* end, uint64_t* v) {
+    *v = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool saveTrace (const Trace* trace, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+
+    fwrite("C8TR", 1, 4, file);
+    fputc(TRACE_VERSION, file);
+    putVarint(file, trace->ipf);
+    fputc(trace->quirks, file);
+    for (unsigned i = 0; i < 8; i++) fputc(trace->program >> (8 * i), file);
+
+    uint64_t tick = 0, cycle = 0;
+    for (const TraceEvent& e : trace->events) {
+        if (e.tick != tick) putVarint(file, (e.tick - tick) << 3 | TRACE_TICK);
+        uint64_t delta = e.cycle - cycle;
+        if (e.type == TRACE_DOWN || e.type == TRACE_UP) {
+            putVarint(file, delta << 7 | (uint64_t)e.value << 3 | e.type);
+        } else {
+            putVarint(file, delta << 3 | e.type);
+            if (e.type == TRACE_RND) fputc(e.value, file);
+        }
+        tick  = e.tick;
+        cycle = e.cycle;
+    }
+    putVarint(file, (trace->ticks - tick) << 3 | TRACE_END);
+    return fclose(file) == 0;
+}
+
+bool loadTrace (Trace* trace, const char* filename) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) return false;
+    vector<uint8_t> data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    const uint8_t* p   = data.data();
+    const uint8_t* end = p + data.size();
+    uint64_t v;
+    if (data.size() < 15 || memcmp(p, "C8TR", 4) != 0 || p[4] != TRACE_VERSION) return false;
+    p += 5;
+    if (!getVarint(&p, end, &v) || end - p < 9 || v == 0) return false;
+    if (*p > QUIRKS_XOCHIP) return false;
+    trace->ipf    = v;
+    trace->quirks = (QuirkProfile)*p++;
+    trace->program = 0;
+    for (unsigned i = 0; i < 8; i++) trace->program |= (uint64_t)*p++ << (8 * i);
+
+    uint64_t tick = 0, cycle = 0;
+    trace->events.clear();
+    while (getVarint(&p, end, &v)) {
+        uint8_t type = v & 7;
+        switch (type) {
+            case TRACE_TICK: tick += v >> 3; break;
+            case TRACE_END:
+                trace->ticks  = tick + (v >> 3);
+                trace->replay = true;
+                trace->next   = 0;
+                return true;
+            case TRACE_DOWN: case TRACE_UP:
+                cycle += v >> 7;
+                trace->events.push_back({ tick, cycle, type, (uint8_t)((v >> 3) & 0xF) });
+                break;
+            case TRACE_RND:
+                if (p == end) return false;
+                cycle += v >> 3;
+                trace->events.push_back({ tick, cycle, type, *p++ });
+                break;
+            case TRACE_WAKE:
+                cycle += v >> 3;
+                trace->events.push_back({ tick, cycle, type, 0 });
+                break;
+            default: return false;
+        }
+    }
+    return false;  // Truncated, no TRACE_END
+}
+
+// The usual layout of the hex keypad on a QWERTY keyboard:
+//     1 2 3 C        1 2 3 4
+//     4 5 6 D   <-   Q W E R
+//     7 8 9 E        A S D F
+//     A 0 B F        Z X C V
+int keyFor (char c) {
+    static const char layout[] = "x123qweasdzc4rfv";   // Indexed by key
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    const char* at = strchr(layout, c);
+    return c && at ? at - layout : -1;
+}
+
+#ifndef _WIN32
+/*
+    Terminal input
+    Terminals report key presses but not releases, so a key counts as held until
+    another key is pressed or no repeat has arrived for KEY_HOLD_MS.
+*/
+#define KEY_HOLD_MS 150
+
+static struct termios savedTerminal;
+
+void restoreTerminal () {
+    tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+}
+
+void startTerminalInput (Keypad* pad) {
+    if (!isatty(STDIN_FILENO)) return;
+    tcgetattr(STDIN_FILENO, &savedTerminal);
+    struct termios raw = savedTerminal;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN]  = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    atexit(restoreTerminal);
+
+    thread([pad] {
+        int held = -1;
+        for (;;) {
+            struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+            char c;
+            if (poll(&in, 1, held < 0 ? -1 : KEY_HOLD_MS) > 0 && read(STDIN_FILENO, &c, 1) == 1) {
+                int key = keyFor(c);
+                if (key < 0 || key == held) continue;
+                if (held >= 0) pushKey(pad, held, false);
+                pushKey(pad, key, true);
+                held = key;
+            } else if (held >= 0) {
+                pushKey(pad, held, false);
+                held = -1;
+            }
+        }
+    }).detach();
+}
+#endif
+
+/*
+    Scheduler
+    Paces the VM against a 60 Hz tick. Each tick runs `ipf` instructions, counts
+    both timers down and hands the rows changed during the tick to `present`.
+    Throttled runs sleep until shortly before the next tick and spin the rest of
+    the way on the steady clock, unthrottled runs go flat out. A VM waiting on
+    Fx0A or an idle loop stops for the rest of the tick, and a key that arrives
+    before the next one resumes it straight away.
+*/
+#define TICK_HZ 60
+
+typedef void (*Presenter)(Chip8* vm, const FrameDelta* delta, void* user);
+typedef void (*Poller)(Chip8* vm, void* user);
+
+typedef struct Scheduler {
+    unsigned  ipf       = 11;      // Instructions per tick, ~660 Hz
+    bool      throttled = true;
+    Presenter present   = nullptr;
+    Poller    poll      = nullptr; // Called at the start of every tick, e.g. to pump window events
+    void*     user      = nullptr;
+    uint64_t  ticks     = 0;
+} Scheduler;
+
+// 60 Hz timer tick
+void tickTimers (Chip8* vm) {
+    if (vm->dTimer) vm->dTimer--;
+    if (vm->sTimer) vm->sTimer--;
+}
+
+// Take in queued keys and run on to the tick's deadline, stopping early on Fx0A
+// or an idle loop. A VM woken within the tick resumes here with what is left of
+// the tick's budget; once that is spent the keys stay queued for the next tick.
+void resumeInstructions (Scheduler* sched, Chip8* vm) {
+    vm->waiting = false;
+    if (vm->cycles >= vm->deadline) return;
+    if (vm->trace) vm->trace->now = sched->ticks;
+    if (vm->keypad) drainKeys(vm);
+    else if (vm->trace && vm->trace->replay) replayKeys(vm);
+    while (vm->cycles < vm->deadline && !vm->waiting) runBlock(vm);
+}
+
+// Start a tick: up to `ipf` instructions, see resumeInstructions()
+void runInstructions (Scheduler* sched, Chip8* vm) {
+    vm->deadline = vm->cycles + sched->ipf;
+    resumeInstructions(sched, vm);
+}
+
+void runTick (Scheduler* sched, Chip8* vm) {
+    if (sched->poll) sched->poll(vm, sched->user);
+    runInstructions(sched, vm);
+    tickTimers(vm);
+    sched->ticks++;
+
+    if (sched->present && (vm->display.dirty || vm->display.hires != vm->presentedHires)) {
+        FrameDelta delta;
+        if (presentFrame(vm, &delta)) sched->present(vm, &delta, sched->user);
+    }
+}
+
+// Wait for the tick after `next`, and advance it
+void waitTick (chrono::steady_clock::time_point* next) {
+    typedef chrono::steady_clock clock;
+    const clock::duration period = chrono::nanoseconds(1000000000 / TICK_HZ);
+    const clock::duration slack  = chrono::milliseconds(2);
+
+    *next += period;
+    clock::time_point now = clock::now();
+    if (now > *next + period) {
+        // Fell more than a tick behind, don't try to catch up in a burst
+        *next = now;
+        return;
+    }
+    if (*next - now > slack) this_thread::sleep_until(*next - slack);
+    while (clock::now() < *next) {}
+}
+
+// Set from SIGINT or by closing the window, ends runScheduler() after the current tick
+static volatile sig_atomic_t stopRequested = 0;
+
+// Run `ticks` ticks, or until stopped when ticks is 0
+void runScheduler (Scheduler* sched, Chip8* vm, uint64_t ticks) {
+    chrono::steady_clock::time_point next = chrono::steady_clock::now();
+
+    const chrono::steady_clock::duration period = chrono::nanoseconds(1000000000 / TICK_HZ);
+
+    for (uint64_t t = 0; (!ticks || t < ticks) && !stopRequested; t++) {
+        runTick(sched, vm);
+        if (!sched->throttled) continue;
+
+        // Nothing to run until the next tick, sleep instead of spinning to it
+        if (vm->waiting && !vm->keypad) this_thread::sleep_until(next + period);
+        while (vm->waiting && vm->keypad && parkKeypad(vm->keypad, next + period)) {
+            if (vm->trace) {
+                vm->trace->now = sched->ticks;
+                traceEvent(vm->trace, vm->cycles, TRACE_WAKE, 0);
+            }
+            resumeInstructions(sched, vm);
+        }
+        waitTick(&next);
+    }
+}
+
+// Draw changed rows to an ANSI terminal, one character per pixel. Pixels lit on
+// plane 0 only, plane 1 only and both planes get different shades.
+void presentTerminal (Chip8*, const FrameDelta* delta, void*) {
+    static const char* shades[4] = { " ", "\u2588", "\u2592", "\u2593" };
+    unsigned width = delta->hires ? 128 : 64;
+
+    if (delta->resized) printf("\x1b[2J");
+    for (unsigned i = 0; i < delta->count; i++) {
+        char line[128 * 3 + 1], *p = line;
+        for (unsigned x = 0; x < width; x++) {
+            unsigned shade = 0;
+            for (unsigned plane = 0; plane < PLANES; plane++) {
+                shade |= ((delta->rows[i][plane][x >> 6] >> (63 - (x & 63))) & 1) << plane;
+            }
+            size_t len = strlen(shades[shade]);
+            memcpy(p, shades[shade], len);
+            p += len;
+        }
+        *p = 0;
+        printf("\x1b[%u;1H%s", delta->index[i] + 1, line);
+    }
+    fflush(stdout);
+}
+
+#if CHIP8_COROUTINES
+/*
+    Coroutine sessions
+    For embedding many interactive VMs in one event driven server. A Session is
+    a VM with its own keypad and tick clock, driven by a coroutine that suspends
+    between ticks instead of sleeping, so any number of sessions share the few
+    threads of an Executor:
+
+        Task play (Session* s) {
+            for (;;) {
+                co_await runUntilFrame(s);
+                ... send s->vm's frame ...
+            }
+        }
+        spawn(&executor, play(s));
+
+    runUntilFrame() waits for the session's next tick and runs it. While the VM
+    is blocked, on Fx0A or in an idle loop waiting for a timer, a queued key also
+    ends the wait and the VM carries on mid tick, as in runScheduler().
+    nextKey() suspends until a key is queued. Keys come from any one thread
+    through sendKey().
+
+    A suspended session holds a ticket. The executor's timer and sendKey() race
+    to clear it and only the winner resumes the coroutine, so stale timers and
+    late keys are harmless.
+*/
+#define WAKE_TICK 0
+#define WAKE_KEY  1
+
+struct Executor;
+
+// Lazily started coroutine. Awaiting a Task runs it and resumes the awaiter when
+// it returns; spawn() runs one detached on an Executor instead.
+typedef struct Task {
+    struct promise_type {
+        struct Final {
+            bool               await_ready () noexcept { return false; }
+            coroutine_handle<> await_suspend (coroutine_handle<promise_type> h) noexcept;
+            void               await_resume () noexcept {}
+        };
+
+        coroutine_handle<> continuation;
+        Executor*          executor = nullptr;  // Set once spawned
+
+        Task           get_return_object () { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend () noexcept { return {}; }
+        Final          final_suspend () noexcept { return {}; }
+        void           return_void () {}
+        void           unhandled_exception () { terminate(); }
+    };
+
+    coroutine_handle<promise_type> handle;
+
+    explicit Task (coroutine_handle<promise_type> h) : handle(h) {}
+    Task (Task&& task) : handle(exchange(task.handle, nullptr)) {}
+    ~Task () { if (handle) handle.destroy(); }
+
+    bool               await_ready () { return false; }
+    coroutine_handle<> await_suspend (coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    void               await_resume () {}
+} Task;
+
+typedef struct Session {
+    Chip8*             vm       = nullptr;
+    Keypad             keypad;
+    Scheduler          sched;
+    Executor*          executor = nullptr;
+    chrono::steady_clock::time_point next;  // When the next tick is due
+    atomic<uint64_t>   ticket   { 0 };      // (serial << 1) | WAKE_KEY if a key may end the wait, 0 while running
+    uint64_t           serial   = 0;
+    coroutine_handle<> waiter;
+    uint8_t            woken    = WAKE_TICK;
+} Session;
+
+typedef struct Executor {
+    mutex                     lock;
+    condition_variable        wake;
+    condition_variable        idle;
+    deque<coroutine_handle<>> ready;
+    multimap<chrono::steady_clock::time_point, pair<Session*, uint64_t>> timers;  // Tickets to claim when due
+    vector<thread>            threads;
+    unsigned                  tasks    = 0;   // Spawned and not yet returned
+    bool                      stopping = false;
+} Executor;
+
+coroutine_handle<> Task::promise_type::Final::await_suspend (coroutine_handle<promise_type> h) noexcept {
+    promise_type& promise = h.promise();
+    if (promise.continuation) return promise.continuation;
+
+    Executor* ex = promise.executor;
+    h.destroy();
+    if (ex) {
+        lock_guard<mutex> guard(ex->lock);
+        if (--ex->tasks == 0) ex->idle.notify_all();
+    }
+    return noop_coroutine();
+}
+
+void schedule (Executor* ex, coroutine_handle<> h) {
+    lock_guard<mutex> guard(ex->lock);
+    ex->ready.push_back(h);
+    ex->wake.notify_one();
+}
+
+// Clear s's ticket if it is still `ticket`, making the caller the one to resume it
+bool claim (Session* s, uint64_t ticket, uint8_t why) {
+    if (!s->ticket.compare_exchange_strong(ticket, 0, memory_order_seq_cst)) return false;
+    s->woken = why;
+    return true;
+}
+
+void workExecutor (Executor* ex) {
+    unique_lock<mutex> guard(ex->lock);
+    while (!ex->stopping) {
+        auto now = chrono::steady_clock::now();
+        while (!ex->timers.empty() && ex->timers.begin()->first <= now) {
+            pair<Session*, uint64_t> due = ex->timers.begin()->second;
+            ex->timers.erase(ex->timers.begin());
+            if (claim(due.first, due.second, WAKE_TICK)) ex->ready.push_back(due.first->waiter);
+        }
+        if (!ex->ready.empty()) {
+            coroutine_handle<> h = ex->ready.front();
+            ex->ready.pop_front();
+            guard.unlock();
+            h.resume();
+            guard.lock();
+        } else if (ex->timers.empty()) {
+            ex->wake.wait(guard);
+        } else {
+            ex->wake.wait_until(guard, ex->timers.begin()->first);
+        }
+    }
+}
+
+void startExecutor (Executor* ex, unsigned threads) {
+    for (unsigned i = 0; i < threads; i++) ex->threads.emplace_back(workExecutor, ex);
+}
+
+// Wait for every spawned task to return, then stop the threads
+void stopExecutor (Executor* ex) {
+    {
+        unique_lock<mutex> guard(ex->lock);
+        ex->idle.wait(guard, [ex] { return ex->tasks == 0; });
+        ex->stopping = true;
+        ex->wake.notify_all();
+    }
+    for (thread& t : ex->threads) t.join();
+    ex->threads.clear();
+}
+
+void spawn (Executor* ex, Task task) {
+    coroutine_handle<Task::promise_type> h = exchange(task.handle, nullptr);
+    h.promise().executor = ex;
+    lock_guard<mutex> guard(ex->lock);
+    ex->tasks++;
+    ex->ready.push_back(h);
+    ex->wake.notify_one();
+}
+
+Session* openSession (Executor* ex, const char* rom) {
+    Session* s = new Session;
+    s->vm      = new Chip8;
+    if (!initVM(s->vm, rom)) {
+        delete s->vm;
+        delete s;
+        return nullptr;
+    }
+    s->vm->keypad = &s->keypad;
+    s->executor   = ex;
+    s->next       = chrono::steady_clock::now();
+    return s;
+}
+
+// Once no task uses s any more
+void closeSession (Session* s) {
+    Executor* ex = s->executor;
+    {
+        lock_guard<mutex> guard(ex->lock);
+        for (auto i = ex->timers.begin(); i != ex->timers.end(); ) {
+            i = i->second.first == s ? ex->timers.erase(i) : next(i);
+        }
+    }
+    delete s->vm;
+    delete s;
+}
+
+bool keyQueued (Keypad* pad) {
+    return pad->head.load(memory_order_seq_cst) != pad->tail.load(memory_order_relaxed);
+}
+
+// Any one thread: queue a key change, resuming s if it is waiting on keys
+bool sendKey (Session* s, unsigned key, bool down) {
+    if (!pushKey(&s->keypad, key, down)) return false;
+    uint64_t ticket = s->ticket.load(memory_order_seq_cst);
+    if ((ticket & WAKE_KEY) && claim(s, ticket, WAKE_KEY)) schedule(s->executor, s->waiter);
+    return true;
+}
+
+// Suspends until s's next tick is due if `timed`, and until a key is queued if
+// `keys`. Resumes with WAKE_TICK or WAKE_KEY.
+typedef struct SessionWait {
+    Session* s;
+    bool     timed, keys;
+
+    bool await_ready () { return keys && keyQueued(&s->keypad) && (s->woken = WAKE_KEY, true); }
+    bool await_suspend (coroutine_handle<> h) {
+        // Once the ticket is out another thread may resume, and end, this wait
+        Session* session = s;
+        bool     keyed   = keys;
+        uint64_t ticket  = (++session->serial << 1) | (keyed ? WAKE_KEY : 0);
+
+        session->waiter = h;
+        if (timed) {
+            lock_guard<mutex> guard(session->executor->lock);
+            session->executor->timers.insert({ session->next, { session, ticket } });
+            session->ticket.store(ticket, memory_order_seq_cst);
+            session->executor->wake.notify_one();
+        } else {
+            session->ticket.store(ticket, memory_order_seq_cst);
+        }
+
+        // A key queued just before the ticket went out found nothing to wake
+        return !(keyed && keyQueued(&session->keypad) && claim(session, ticket, WAKE_KEY));
+    }
+    uint8_t await_resume () { return s->woken; }
+} SessionWait;
+
+// Wait for s's next tick, running the VM on as keys unblock it meanwhile, then
+// run the tick
+Task runUntilFrame (Session* s) {
+    const chrono::steady_clock::duration period = chrono::nanoseconds(1000000000 / TICK_HZ);
+    Chip8* vm = s->vm;
+
+    while (co_await SessionWait{ s, true, vm->waiting } == WAKE_KEY) {
+        if (vm->trace) {
+            vm->trace->now = s->sched.ticks;
+            traceEvent(vm->trace, vm->cycles, TRACE_WAKE, 0);
+        }
+        resumeInstructions(&s->sched, vm);
+    }
+    runTick(&s->sched, vm);
+
+    // Fell more than a tick behind, don't try to catch up in a burst
+    s->next += period;
+    auto now = chrono::steady_clock::now();
+    if (now > s->next + period) s->next = now;
+}
+
+// Suspend until a key change is queued for s and return its key. The change
+// stays queued for the VM's next tick.
+typedef struct KeyWait {
+    SessionWait wait;
+
+    bool     await_ready () { return wait.await_ready(); }
+    bool     await_suspend (coroutine_handle<> h) { return wait.await_suspend(h); }
+    unsigned await_resume () {
+        Keypad* pad = &wait.s->keypad;
+        return pad->events[pad->tail.load(memory_order_relaxed) % KEY_QUEUE] & 0xF;
+    }
+} KeyWait;
+
+KeyWait nextKey (Session* s) {
+    return { { s, false, true } };
+}
+
+// A session playing `frames` frames
+Task playSession (Session* s, uint64_t frames, atomic<uint64_t>* played) {
+    for (uint64_t f = 0; f < frames; f++) {
+        co_await runUntilFrame(s);
+        (*played)++;
+    }
+}
+
+// CHIP8 --sessions <rom> <count> [frames] [threads]
+// Runs `count` sessions at 60 Hz on a few threads while another thread feeds
+// them random keys, like a server with that many connected players
+int runSessions (const char* rom, unsigned count, uint64_t frames, unsigned threads) {
+    Executor ex;
+    vector<Session*> sessions;
+    for (unsigned i = 0; i < count; i++) {
+        Session* s = openSession(&ex, rom);
+        if (!s) {
+            fprintf(stderr, "%s: cannot load ROM\n", rom);
+            return 1;
+        }
+        seedRandom(&s->vm->rng, 0, i);
+        sessions.push_back(s);
+    }
+
+    atomic<uint64_t> played { 0 };
+    atomic<bool>     done   { false };
+    clock_t cpu   = clock();
+    auto    start = chrono::steady_clock::now();
+    startExecutor(&ex, threads);
+    for (Session* s : sessions) spawn(&ex, playSession(s, frames, &played));
+
+    thread input([&] {
+        Random rng;
+        seedRandom(&rng, 1, 0);
+        while (!done) {
+            Session* s   = sessions[(nextRandom(&rng) | nextRandom(&rng) << 8) % count];
+            unsigned key = nextRandom(&rng) & 0xF;
+            sendKey(s, key, true);
+            sendKey(s, key, false);
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+    });
+    stopExecutor(&ex);
+    done = true;
+    input.join();
+
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double used = (double)(clock() - cpu) / CLOCKS_PER_SEC;
+    printf("%u sessions, %u threads, %llu frames in %.2f s (%.1f fps per session), %.2f s CPU\n",
+           count, threads, (unsigned long long)played.load(), wall, played / wall / count, used);
+    for (Session* s : sessions) closeSession(s);
+    return 0;
+}
+#endif
+
+/*
+    Triple buffer
+    Hands frames from an emulation thread to a render thread without either
+    waiting on the other. The writer fills `back` and swaps it with the shared
+    middle frame; the reader swaps `front` with the middle frame when it holds
+    one it hasn't seen. Each side only ever touches its own frame and the one
+    atomic index. The writer ORs row masks together until it sees the reader
+    has taken a frame, so `mask` always covers every row changed since the
+    reader's previous frame, however many frames it skipped.
+*/
+#define TB_FRESH 4   // Set in `middle` while it holds an unread frame
+
+typedef struct SharedFrame {
+    uint64_t rows[PLANES][64][2];
+    uint64_t mask;                  // Rows changed since the frame the reader last took
+    bool     hires;
+} SharedFrame;
+
+typedef struct TripleBuffer {
+    SharedFrame      frames[3] = {};
+    atomic<unsigned> middle { 1 };
+    unsigned         back    = 0;   // Writer's frame
+    unsigned         front   = 2;   // Reader's frame
+    uint64_t         pending = 0;   // Writer's, rows changed since the reader's last frame
+} TripleBuffer;
+
+void publishFrame (TripleBuffer* tb, const Display* d, uint64_t mask) {
+    SharedFrame* frame = &tb->frames[tb->back];
+    memcpy(frame->rows, d->rows, sizeof(frame->rows));
+    frame->mask  = tb->pending |= mask;
+    frame->hires = d->hires;
+
+    // Getting back a read frame means the reader holds the previous publish
+    unsigned old = tb->middle.exchange(tb->back | TB_FRESH, memory_order_acq_rel);
+    tb->back     = old & 3;
+    if (!(old & TB_FRESH)) tb->pending = mask;
+}
+
+// Latest frame if one was published since the last call, else nullptr
+const SharedFrame* takeFrame (TripleBuffer* tb) {
+    if (!(tb->middle.load(memory_order_acquire) & TB_FRESH)) return nullptr;
+    tb->front = tb->middle.exchange(tb->front, memory_order_acq_rel) & 3;
+    return &tb->frames[tb->front];
+}
+
+// Presenter that publishes into the TripleBuffer passed as `user`
+void presentShared (Chip8* vm, const FrameDelta* delta, void* user) {
+    publishFrame((TripleBuffer*)user, &vm->display, delta->mask);
+}
+
+#if CHIP8_GL
+/*
+    GL render backend
+    Built with -DCHIP8_GL=1 and linked with -lGL -lglut. The packed display is
+    uploaded as-is into one layer of an 8 x 64 R32UI texture array, one texel
+    row per display row holding the two words of each plane as high / low
+    halves, and the fragment shader picks out the pixel's bit on each plane and
+    maps the pair through a four entry palette. Nothing is expanded to RGBA on
+    the CPU. A renderer with several layers tiles them across the window.
+
+    Rows go through a persistently mapped pixel unpack buffer split into
+    GL_FRAMES regions. Each region is fenced after its upload and only reused
+    once the GPU is done with it, so a frame neither allocates nor waits on the
+    driver. Only changed rows are copied and uploaded.
+*/
+#define GL_FRAMES    3
+#define GL_ROW_WORDS (PLANES * 2 * 2)              // uint32 texels per row
+#define GL_ROW_BYTES (GL_ROW_WORDS * 4)
+#define GL_LAYER     (64 * GL_ROW_BYTES)           // One full display
+
+typedef struct GLRenderer {
+    GLuint   program  = 0;
+    GLuint   vao      = 0;
+    GLuint   pbo      = 0;
+    GLuint   texture  = 0;
+    GLint    hiresLoc = -1;
+    GLint    layerLoc = -1;
+    unsigned layers   = 1;                // Displays, tiled in a grid
+    uint8_t* mapped   = nullptr;          // pbo, mapped for the renderer's lifetime
+    GLsync   fences[GL_FRAMES] = {};      // Last upload from each region
+    unsigned region   = 0;                // Region being filled
+    vector<bool> hires;                   // Per layer
+    Keypad*  keypad   = nullptr;          // Receives the window's key events
+    int      width    = 640;
+    int      height   = 320;
+    bool     closed   = false;
+} GLRenderer;
+
+// Full screen triangle, uv (0, 0) at the bottom left of the viewport
+static const char* glVertexShader = R"(#version 440 core
+out vec2 uv;
+void main() {
+    uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+static const char* glFragmentShader = R"(#version 440 core
+uniform usampler2DArray display;
+uniform bool hires;
+uniform int layer;
+uniform vec4 palette[4];
+in vec2 uv;
+out vec4 color;
+void main() {
+    uvec2 size = hires ? uvec2(128u, 64u) : uvec2(64u, 32u);
+    uvec2 p = min(uvec2(vec2(uv.x, 1.0 - uv.y) * vec2(size)), size - 1u);
+    uint shade = 0u;
+    for (uint plane = 0u; plane < 2u; plane++) {
+        uint bits = texelFetch(display, ivec3(plane * 4u + (p.x >> 5), p.y, layer), 0).r;
+        shade |= ((bits >> (31u - (p.x & 31u))) & 1u) << plane;
+    }
+    color = palette[shade];
+}
+)";
+
+GLuint compileShader (GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        fprintf(stderr, "shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Once the context is current: build the program and the buffer objects
+bool setupGL (GLRenderer* gl) {
+    GLuint vs = compileShader(GL_VERTEX_SHADER, glVertexShader);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, glFragmentShader);
+    if (!vs || !fs) return false;
+
+    gl->program = glCreateProgram();
+    glAttachShader(gl->program, vs);
+    glAttachShader(gl->program, fs);
+    glLinkProgram(gl->program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok = 0;
+    glGetProgramiv(gl->program, GL_LINK_STATUS, &ok);
+    if (!ok) return false;
+
+    // Plane 0, plane 1, both, as the terminal shades them
+    static const GLfloat palette[4][4] = {
+        { 0.0f,  0.0f,  0.0f,  1.0f },
+        { 1.0f,  1.0f,  1.0f,  1.0f },
+        { 0.5f,  0.5f,  0.5f,  1.0f },
+        { 0.75f, 0.75f, 0.75f, 1.0f },
+    };
+    glUseProgram(gl->program);
+    glUniform1i(glGetUniformLocation(gl->program, "display"), 0);
+    glUniform4fv(glGetUniformLocation(gl->program, "palette"), 4, &palette[0][0]);
+    gl->hiresLoc = glGetUniformLocation(gl->program, "hires");
+    gl->layerLoc = glGetUniformLocation(gl->program, "layer");
+    gl->hires.assign(gl->layers, false);
+
+    // Attributeless draw, but core profile still wants a VAO bound
+    glGenVertexArrays(1, &gl->vao);
+    glBindVertexArray(gl->vao);
+
+    glGenTextures(1, &gl->texture);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gl->texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R32UI, GL_ROW_WORDS, 64, gl->layers);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    GLuint zero = 0;
+    glClearTexImage(gl->texture, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    const GLsizeiptr size  = (GLsizeiptr)GL_FRAMES * gl->layers * GL_LAYER;
+    glGenBuffers(1, &gl->pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gl->pbo);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+    gl->mapped = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    return gl->mapped != nullptr;
+}
+
+// Start a frame's uploads: take the next region, once the GPU is done with it
+void beginUploadGL (GLRenderer* gl) {
+    unsigned r = gl->region = (gl->region + 1) % GL_FRAMES;
+    if (gl->fences[r]) {
+        // Three frames back, already signalled unless the GPU is far behind
+        glClientWaitSync(gl->fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(gl->fences[r]);
+        gl->fences[r] = nullptr;
+    }
+}
+
+// Copy the changed rows into the region and upload each run of consecutive
+// rows with one glTexSubImage3D from the buffer
+void uploadGL (GLRenderer* gl, unsigned layer, const FrameDelta* delta) {
+    size_t   offset = ((size_t)gl->region * gl->layers + layer) * GL_LAYER;
+    uint8_t* base   = gl->mapped + offset;
+    for (unsigned i = 0; i < delta->count; i++) {
+        uint32_t* texels = (uint32_t*)(base + delta->index[i] * GL_ROW_BYTES);
+        for (unsigned p = 0; p < PLANES; p++) {
+            for (unsigned w = 0; w < 2; w++) {
+                texels[p * 4 + w * 2 + 0] = (uint32_t)(delta->rows[i][p][w] >> 32);
+                texels[p * 4 + w * 2 + 1] = (uint32_t)delta->rows[i][p][w];
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < delta->count; ) {
+        unsigned first = delta->index[i], last = first;
+        while (++i < delta->count && delta->index[i] == last + 1) last++;
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, first, layer, GL_ROW_WORDS, last - first + 1, 1,
+                        GL_RED_INTEGER, GL_UNSIGNED_INT, (const void*)(uintptr_t)(offset + first * GL_ROW_BYTES));
+    }
+    gl->hires[layer] = delta->hires;
+}
+
+void endUploadGL (GLRenderer* gl) {
+    gl->fences[gl->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Tile the layers row by row in the squarest grid that holds them, each tile
+// 2:1 and as large as the window allows
+void drawGL (GLRenderer* gl) {
+    unsigned cols = 1;
+    while (cols * cols < gl->layers) cols++;
+    unsigned rows  = (gl->layers + cols - 1) / cols;
+    int      tileW = min(gl->width / (int)cols, 2 * gl->height / (int)rows);
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    for (unsigned l = 0; l < gl->layers; l++) {
+        int x = (l % cols) * tileW;
+        int y = gl->height - (int)(l / cols + 1) * (tileW / 2);
+        glViewport(x, y, tileW, tileW / 2);
+        glUniform1i(gl->hiresLoc, gl->hires[l]);
+        glUniform1i(gl->layerLoc, l);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+    glutSwapBuffers();
+}
+
+// glut callbacks carry no user pointer, there is one window per process
+static GLRenderer* glWindow = nullptr;
+
+void presentGL (Chip8*, const FrameDelta* delta, void* user) {
+    GLRenderer* gl = (GLRenderer*)user;
+    beginUploadGL(gl);
+    uploadGL(gl, 0, delta);
+    endUploadGL(gl);
+    drawGL(gl);
+}
+
+void pollGL (Chip8*, void* user) {
+    glutMainLoopEvent();
+    if (((GLRenderer*)user)->closed) stopRequested = 1;
+}
+
+// Open a window of gl->width x gl->height and set the renderer up in its context
+bool initGL (GLRenderer* gl, int* argc, char** argv, const char* title) {
+    glutInit(argc, argv);
+    glutInitContextVersion(4, 4);
+    glutInitContextProfile(GLUT_CORE_PROFILE);
+    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE);
+    glutInitWindowSize(gl->width, gl->height);
+    glutCreateWindow(title);
+    glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+
+    glWindow = gl;
+    glutDisplayFunc([] { drawGL(glWindow); });
+    glutReshapeFunc([] (int w, int h) { glWindow->width = w; glWindow->height = h; });
+    glutCloseFunc([] { glWindow->closed = true; });
+
+    // glut reports releases, so keys are held exactly as long as they are down
+    glutIgnoreKeyRepeat(1);
+    glutKeyboardFunc([] (unsigned char c, int, int) {
+        int key = keyFor(c);
+        if (key >= 0 && glWindow->keypad) pushKey(glWindow->keypad, key, true);
+    });
+    glutKeyboardUpFunc([] (unsigned char c, int, int) {
+        int key = keyFor(c);
+        if (key >= 0 && glWindow->keypad) pushKey(glWindow->keypad, key, false);
+    });
+    return setupGL(gl);
+}
+#endif
+
+// FNV-1a over the visible rows of plane 0, then plane 1 if anything is lit on it.
+// A lores single plane frame hashes the same bytes as the original 64x32 layout.
+uint64_t displayHash (const Display* d) {
+    uint64_t hash   = 0xCBF29CE484222325ull;
+    unsigned words  = d->hires ? 2 : 1;
+    unsigned height = displayHeight(d);
+
+    for (unsigned p = 0; p < PLANES; p++) {
+        if (p > 0) {
+            bool lit = false;
+            for (unsigned y = 0; y < 64; y++) lit |= (d->rows[p][y][0] | d->rows[p][y][1]) != 0;
+            if (!lit) break;
+        }
+        for (unsigned y = 0; y < height; y++) {
+            const uint8_t* bytes = (const uint8_t*)d->rows[p][y];
+            for (unsigned i = 0; i < words * 8; i++) {
+                hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+            }
+        }
+    }
+    if (d->hires) hash = (hash ^ 0xFF) * 0x100000001B3ull;
+    return hash;
+}
+
+uint64_t displayHash (const Chip8* vm) {
+    return displayHash(&vm->display);
+}
+
+/*
+    Headless mode
+    Runs a ROM for a fixed number of frames (scheduler ticks) with no presenter
+    and no pacing, so the result depends only on the ROM and the settings. The
+    display hash is taken at chosen frames and either printed, written to a
+    golden file, or compared against one. Golden files hold one `<frame> <hash>`
+    pair per line, `#` starts a comment.
+*/
+typedef struct FrameHash {
+    uint64_t frame;
+    uint64_t hash;
+} FrameHash;
+
+bool readGolden (const char* filename, vector<FrameHash>* golden) {
+    ifstream file(filename);
+    if (!file.is_open()) return false;
+
+    string line;
+    while (getline(file, line)) {
+        unsigned long long frame, hash;
+        if (line.empty() || line[0] == '#') continue;
+        if (sscanf(line.c_str(), "%llu %llx", &frame, &hash) == 2) golden->push_back({ frame, hash });
+    }
+    sort(golden->begin(), golden->end(), [](const FrameHash& a, const FrameHash& b) { return a.frame < b.frame; });
+    return true;
+}
+
+bool writeGolden (const char* filename, const char* rom, const vector<FrameHash>& hashes) {
+    FILE* file = fopen(filename, "w");
+    if (!file) return false;
+
+    fprintf(file, "# %s\n", rom);
+    for (const FrameHash& h : hashes) {
+        fprintf(file, "%llu %016llx\n", (unsigned long long)h.frame, (unsigned long long)h.hash);
+    }
+    fclose(file);
+    return true;
+}
+
+// Run unpaced, hashing the display after every frame listed in `at` (ascending)
+vector<FrameHash> runHeadless (Chip8* vm, unsigned ipf, const vector<uint64_t>& at) {
+    Scheduler sched;
+    sched.ipf       = ipf;
+    sched.throttled = false;
+
+    // Once the program halts the display is final, the remaining frames are skipped
+    vector<FrameHash> hashes;
+    for (uint64_t frame : at) {
+        while (sched.ticks < frame && !halted(vm)) {
+            runTick(&sched, vm);
+            while (vm->waiting && replayWake(vm, sched.ticks)) resumeInstructions(&sched, vm);
+        }
+        hashes.push_back({ frame, displayHash(vm) });
+    }
+    return hashes;
+}
+
+// CHIP8 --analyze <rom>
+int analyzeMain (const char* rom) {
+    Chip8* vm = new Chip8;
+    if (!initVM(vm, rom)) {
+        fprintf(stderr, "%s: cannot load ROM\n", rom);
+        return 1;
+    }
+    ROMMap* map = new ROMMap;
+    analyzeROM(vm->ram, map);
+    printAnalysis(vm->ram, map);
+    delete map;
+    delete vm;
+    return 0;
+}
+
+void printLogRecord (const LogRecord* r, const string& changes) {
+    char text[32];
+    disassemble(text, sizeof(text), r->instr);
+    if (changes.empty()) printf("%10u  %03X  %04X  %s\n", r->cycle, r->pc, r->instr, text);
+    else                 printf("%10u  %03X  %04X  %-20s%s\n", r->cycle, r->pc, r->instr, text, changes.c_str());
+}
+
+// CHIP8 --decode <log>, one line per logged instruction with the registers it
+// changed, which the last one and those before a gap can't show
+int decodeLog (const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    uint8_t header[6];
+    if (!file || fread(header, 1, 6, file) != 6 || memcmp(header, "C8XL", 4) != 0 ||
+        header[4] != LOG_VERSION || header[5] != sizeof(LogRecord)) {
+        fprintf(stderr, "%s: not an execution log\n", filename);
+        if (file) fclose(file);
+        return 1;
+    }
+
+    static LogRecord records[4096];
+    LogRecord prev;
+    uint64_t  count = 0, gaps = 0;
+    size_t    n;
+    printf("     cycle   pc  instr\n");
+    while ((n = fread(records, sizeof(LogRecord), 4096, file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const LogRecord* r = &records[i];
+            if (count++) {
+                uint32_t skipped = r->cycle - prev.cycle - 1;
+                printLogRecord(&prev, skipped ? string() : logChanges(&prev, r));
+                if (skipped) {
+                    printf("           ... %u instructions not logged\n", skipped);
+                    gaps++;
+                }
+            }
+            prev = *r;
+        }
+    }
+    if (count) printLogRecord(&prev, string());
+    printf("%llu instructions, %llu gaps\n", (unsigned long long)count, (unsigned long long)gaps);
+    fclose(file);
+    return 0;
+}
+
+// CHIP8 --headless <rom> [--ipf n] [--frames n | --cycles n] [--every n] [--golden file [--record]]
+int headlessMain (int argc, char** argv) {
+    const char* rom    = nullptr;
+    const char* golden = nullptr;
+    const char* replay = nullptr;
+    const char* log    = nullptr;
+    bool        record = false, bad = false;
+    QuirkProfile quirks = QUIRKS_CHIP8;
+    unsigned    ipf    = 11;
+    uint64_t    frames = 0, cycles = 0, every = 0, seed = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)         ipf    = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) frames = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) cycles = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc)  every  = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) golden = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0)                 record = true;
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay = argv[++i];
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)    log    = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)   seed   = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) bad |= !parseQuirks(argv[++i], &quirks);
+        else rom = argv[i];
+    }
+    if (!rom || !ipf || bad || (record && !golden)) {
+        fprintf(stderr, "usage: --headless <rom> [--ipf n] [--quirks profile] [--frames n | --cycles n] [--every n] [--golden file [--record]] [--replay trace] [--log file] [--seed n]\n");
+        return 1;
+    }
+
+    if (log && !logging) {
+        fprintf(stderr, "--log needs a build with CHIP8_LOG=1\n");
+        return 1;
+    }
+
+    // A trace brings its own settings, and runs for the whole session by default
+    Trace* trace = nullptr;
+    if (replay) {
+        trace = new Trace;
+        if (!loadTrace(trace, replay)) {
+            fprintf(stderr, "%s: cannot read trace\n", replay);
+            return 1;
+        }
+        ipf    = trace->ipf;
+        quirks = trace->quirks;
+        if (!frames && !cycles) frames = trace->ticks;
+    }
+    if (cycles) frames = (cycles + ipf - 1) / ipf;
+    if (!frames) frames = 600;
+
+    // Frames to hash: those in the golden file when checking, else every n-th and the last
+    vector<FrameHash> expected;
+    vector<uint64_t>  at;
+    if (golden && !record) {
+        if (!readGolden(golden, &expected) || expected.empty()) {
+            fprintf(stderr, "%s: cannot read golden hashes\n", golden);
+            return 1;
+        }
+        for (const FrameHash& h : expected) at.push_back(h.frame);
+    } else {
+        for (uint64_t f = every; every && f < frames; f += every) at.push_back(f);
+        at.push_back(frames);
+    }
+
+    Chip8* vm = new Chip8;
+    if (!initVM(vm, rom)) {
+        fprintf(stderr, "%s: cannot load ROM\n", rom);
+        return 1;
+    }
+    useQuirks(vm, quirks);
+    seedRandom(&vm->rng, seed, 0);
+    if (trace && trace->program != programHash(vm)) {
+        fprintf(stderr, "%s: trace was recorded with another ROM\n", replay);
+        return 1;
+    }
+    vm->trace = trace;
+    if (log && !openLog(vm, log, true)) {
+        fprintf(stderr, "%s: cannot write log\n", log);
+        return 1;
+    }
+    vector<FrameHash> hashes = runHeadless(vm, ipf, at);
+    if (log && !closeLog(vm, nullptr)) {
+        fprintf(stderr, "%s: cannot write log\n", log);
+        return 1;
+    }
+    delete vm;
+    if (trace && trace->diverged) fprintf(stderr, "%s: warning, replay diverged from the recording\n", replay);
+
+    if (record) {
+        if (!writeGolden(golden, rom, hashes)) {
+            fprintf(stderr, "%s: cannot write golden hashes\n", golden);
+            return 1;
+        }
+        return 0;
+    }
+    if (!golden) {
+        for (const FrameHash& h : hashes) {
+            printf("%llu %016llx\n", (unsigned long long)h.frame, (unsigned long long)h.hash);
+        }
+        return 0;
+    }
+
+    unsigned failures = 0;
+    for (unsigned i = 0; i < hashes.size(); i++) {
+        if (hashes[i].hash == expected[i].hash) continue;
+        printf("FAIL %s frame %llu: expected %016llx, got %016llx\n", rom, (unsigned long long)hashes[i].frame,
+               (unsigned long long)expected[i].hash, (unsigned long long)hashes[i].hash);
+        failures++;
+    }
+    if (!failures) printf("ok %s (%zu frames checked)\n", rom, hashes.size());
+    return failures ? 1 : 0;
+}
+
+/*
+    Batch runner
+    Runs a list of ROMs to completion across all cores. The list file holds one
+    instance per line:
+
+        <rom path> [cycle budget] [jit]
+
+    An instance runs in ticks of 11 instructions with the timers counting down
+    once per tick. It stops when it exhausts its budget or halts (see halted():
+    a self-jump, the usual end-of-program idiom, or 00FD). Jobs are
+    dealt round-robin to per-worker queues; an idle worker steals from the front
+    of the others' queues so a few long ROMs don't serialize the run.
+*/
+typedef struct BatchJob {
+    string   rom;
+    uint64_t budget  = 10000000;
+    bool     jit     = false;
+    uint64_t stream  = 0;           // Random stream, the job's line in the list
+
+    // Results
+    uint64_t cycles  = 0;
+    double   seconds = 0;
+    bool     loaded  = false;
+    bool     halted  = false;
+    uint8_t  V[16]   = {};
+    uint16_t I       = 0;
+    uint16_t PC      = 0;
+    uint8_t  SP      = 0;
+    uint64_t hash    = 0;
+} BatchJob;
+
+typedef struct WorkQueue {
+    mutex           lock;
+    deque<unsigned> jobs;
+} WorkQueue;
+
+// Run job in the worker's VM, powered on again for it
+void runJob (BatchJob* job, Chip8* vm) {
+    job->loaded = reset(vm, job->rom.c_str());
+    if (!job->loaded) return;
+    seedRandom(&vm->rng, 0, job->stream);
+    if (job->jit) attachRecompiler(vm);
+
+    // Translate ahead of time, short runs would spend a good part of their
+    // budget decoding on first execution
+    precompileROM(vm);
+
+    // Ticks of the default ipf, so timers run at 60 Hz of emulated time. The
+    // last one is cut short to end on the budget exactly.
+    Scheduler sched;
+    unsigned  ipf   = sched.ipf;
+    auto      start = chrono::steady_clock::now();
+    while (vm->cycles < job->budget) {
+        if (halted(vm)) { job->halted = true; break; }
+        sched.ipf = min<uint64_t>(ipf, job->budget - vm->cycles);
+        runTick(&sched, vm);
+    }
+    job->cycles  = vm->cycles;
+    job->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    memcpy(job->V, vm->V, sizeof(job->V));
+    job->I    = vm->I;
+    job->PC   = vm->PC;
+    job->SP   = vm->SP;
+    job->hash = displayHash(vm);
+
+    detachRecompiler(vm);
+}
+
+// Pop from the back of our own queue, otherwise steal from the front of another
+bool takeJob (WorkQueue* queues, unsigned workers, unsigned self, unsigned* job) {
+    {
+        lock_guard<mutex> guard(queues[self].lock);
+        if (!queues[self].jobs.empty()) {
+            *job = queues[self].jobs.back();
+            queues[self].jobs.pop_back();
+            return true;
+        }
+    }
+    for (unsigned i = 1; i < workers; i++) {
+        WorkQueue& victim = queues[(self + i) % workers];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            *job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+vector<BatchJob> readBatchList (const char* listfile) {
+    vector<BatchJob> jobs;
+    ifstream list(listfile);
+    string line;
+
+    while (getline(list, line)) {
+        char rom[1024], flag[16] = "";
+        unsigned long long budget = 0;
+        if (line.empty() || line[0] == '#') continue;
+        int fields = sscanf(line.c_str(), "%1023s %llu %15s", rom, &budget, flag);
+        if (fields < 1) continue;
+
+        BatchJob job;
+        job.rom = rom;
+        if (fields >= 2 && budget) job.budget = budget;
+        job.jit    = strcmp(flag, "jit") == 0;
+        job.stream = jobs.size();
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+int runBatch (const char* listfile, unsigned workers) {
+    vector<BatchJob> jobs = readBatchList(listfile);
+    if (jobs.empty()) {
+        fprintf(stderr, "no ROMs in %s\n", listfile);
+        return 1;
+    }
+    if (!workers) workers = thread::hardware_concurrency();
+    if (!workers) workers = 1;
+
+    vector<WorkQueue> queues(workers);
+    for (unsigned i = 0; i < jobs.size(); i++) {
+        queues[i % workers].jobs.push_back(i);
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (unsigned w = 0; w < workers; w++) {
+        pool.emplace_back([&, w] {
+            Chip8*   vm = new Chip8;
+            unsigned job;
+            while (takeJob(queues.data(), workers, w, &job)) runJob(&jobs[job], vm);
+            delete vm;
+        });
+    }
+    for (thread& t : pool) t.join();
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t cycles = 0;
+    for (const BatchJob& job : jobs) {
+        if (!job.loaded) {
+            printf("%s error: cannot load ROM\n", job.rom.c_str());
+            continue;
+        }
+        printf("%s %s cycles=%llu mips=%.2f PC=%03X I=%03X SP=%X V=",
+               job.rom.c_str(), job.halted ? "halted" : "budget",
+               (unsigned long long)job.cycles,
+               job.seconds > 0 ? job.cycles / job.seconds / 1e6 : 0.0,
+               job.PC, job.I, job.SP);
+        for (unsigned i = 0; i < 16; i++) printf("%02X", job.V[i]);
+        printf(" hash=%016llx\n", (unsigned long long)job.hash);
+        cycles += job.cycles;
+    }
+    printf("%zu ROMs, %u workers, %.3f s, %.2f MIPS aggregate\n",
+           jobs.size(), workers, total, total > 0 ? cycles / total / 1e6 : 0.0);
+    return 0;
+}
+
+/*
+    Compact hosting
+    A parked instance keeps only what it doesn't share with the other instances
+    of its ROM: registers, timers, keys, generator, display and the ram pages it
+    has written, copied on first write. The power-on ram, the ROM and every page
+    nobody wrote live once in a HostImage. Lores displays are packed into 32
+    words. Instances, pages and full displays all come from per-worker pools, so
+    a warm host allocates nothing.
+
+    Instances run one at a time in their worker's scratch Chip8: resume() copies
+    one in and park() copies it back out. The scratch VM keeps its decode cache
+    between instances of the same image, and resume() only copies the pages the
+    previous and the next instance own. Hosted instances are headless.
+*/
+#define PAGE_BYTES 256
+
+// Fixed size objects carved out of 64 KB chunks and recycled through a free
+// list. One pool per worker, no locking.
+template <typename T>
+struct Pool {
+    vector<T*> chunks;
+    vector<T*> spare;
+    size_t     used = 0;  // Handed out and not given back
+};
+
+template <typename T>
+T* takeFrom (Pool<T>* pool) {
+    if (pool->spare.empty()) {
+        size_t count = sizeof(T) < 65536 ? 65536 / sizeof(T) : 1;
+        T*     chunk = new T[count];
+        pool->chunks.push_back(chunk);
+        for (size_t i = count; i-- > 0; ) pool->spare.push_back(chunk + i);
+    }
+    T* item = pool->spare.back();
+    pool->spare.pop_back();
+    pool->used++;
+    return item;
+}
+
+template <typename T>
+void giveBack (Pool<T>* pool, T* item) {
+    pool->spare.push_back(item);
+    pool->used--;
+}
+
+template <typename T>
+void freePool (Pool<T>* pool) {
+    for (T* chunk : pool->chunks) delete[] chunk;
+    pool->chunks.clear();
+    pool->spare.clear();
+    pool->used = 0;
+}
+
+typedef struct Page {
+    uint8_t bytes[PAGE_BYTES];
+} Page;
+
+// Power-on ram shared by every instance of a ROM
+typedef struct HostImage {
+    uint8_t      ram[4096];
+    QuirkProfile quirks;
+} HostImage;
+
+// A hosted VM between ticks
+typedef struct Parked {
+    const HostImage* image;
+    Page*    pages[16];  // This instance's copy of ram page p, nullptr while it reads the image's
+    Display* full;       // Hires or multi-plane display, nullptr while `lores` holds it
+    uint64_t lores[32];  // Plane 0 rows of a lores display
+    uint64_t rng[4][RANDOM_STREAMS];  // Generator state the pool was filled from, see rewindRandom()
+    uint64_t cycles;
+    uint16_t owned;      // Bit p set while pages[p] is held
+    uint16_t I, PC, stack[16], keys, pressed, rngAt;
+    uint8_t  V[16], SP, dTimer, sTimer, planes;
+} Parked;
+
+typedef struct HostWorker {
+    Chip8*           vm        = nullptr;  // Scratch VM the instances run in
+    const HostImage* image     = nullptr;  // Image in vm->ram, apart from `divergent`
+    uint16_t         divergent = 0;        // Pages of vm->ram that may differ from image
+    Scheduler        sched;
+    Pool<Parked>     parked;
+    Pool<Page>       pages;
+    Pool<Display>    displays;
+    vector<Parked*>  instances;
+} HostWorker;
+
+bool loadHostImage (const char* rom, QuirkProfile quirks, HostImage* image) {
+    Chip8* vm = new Chip8;
+    bool   ok = initVM(vm, rom);
+    memcpy(image->ram, vm->ram, sizeof(image->ram));
+    image->quirks = quirks;
+    delete vm;
+    return ok;
+}
+
+// A powered-on instance of image, seeded like initVM() with stream `stream`
+Parked* hostInstance (HostWorker* worker, const HostImage* image, uint64_t seed, uint64_t stream) {
+    Parked* p = takeFrom(&worker->parked);
+    *p        = Parked();
+    p->image  = image;
+    p->PC     = 0x200;
+    p->planes = 1;
+
+    Random rng;
+    seedRandom(&rng, seed, stream);
+    memcpy(p->rng, rng.s, sizeof(p->rng));
+    p->rngAt = rng.at;
+    return p;
+}
+
+void releaseInstance (HostWorker* worker, Parked* p) {
+    for (unsigned page = 0; page < 16; page++) {
+        if (p->pages[page]) giveBack(&worker->pages, p->pages[page]);
+    }
+    if (p->full) giveBack(&worker->displays, p->full);
+    giveBack(&worker->parked, p);
+}
+
+// Everything but plane 0 of lores rows 0 -- 31 is blank
+bool packable (const Display* d) {
+    if (d->hires) return false;
+    uint64_t rest = 0;
+    for (unsigned p = 0; p < PLANES; p++) {
+        for (unsigned y = 0; y < 64; y++) {
+            rest |= d->rows[p][y][1];
+            if (p || y >= 32) rest |= d->rows[p][y][0];
+        }
+    }
+    return !rest;
+}
+
+// Load p into the worker's scratch VM
+void resume (HostWorker* worker, Parked* p) {
+    Chip8*   vm    = worker->vm;
+    uint16_t pages = worker->divergent | p->owned;
+
+    if (worker->image != p->image) {
+        useQuirks(vm, p->image->quirks);
+        worker->image = p->image;
+        pages         = 0xFFFF;
+    }
+    for (; pages; pages &= pages - 1) {
+        unsigned page = __builtin_ctz(pages);
+        memcpy(vm->ram + page * PAGE_BYTES, p->pages[page] ? p->pages[page]->bytes : p->image->ram + page * PAGE_BYTES, PAGE_BYTES);
+        invalidate(vm, page * PAGE_BYTES, PAGE_BYTES);
+    }
+
+    if (p->full) {
+        vm->display = *p->full;
+    } else {
+        vm->display        = Display();
+        vm->display.planes = p->planes;
+        for (unsigned y = 0; y < 32; y++) vm->display.rows[0][y][0] = p->lores[y];
+    }
+    memcpy(vm->V, p->V, sizeof(vm->V));
+    memcpy(vm->stack, p->stack, sizeof(vm->stack));
+    vm->I          = p->I;
+    vm->PC         = p->PC;
+    vm->SP         = p->SP;
+    vm->dTimer     = p->dTimer;
+    vm->sTimer     = p->sTimer;
+    vm->keys       = p->keys;
+    vm->pressed    = p->pressed;
+    vm->cycles     = p->cycles;
+    memcpy(vm->rng.s, p->rng, sizeof(p->rng));
+    if (p->rngAt < RANDOM_POOL) refillRandom(&vm->rng);
+    vm->rng.at     = p->rngAt;
+    vm->deadline   = UINT64_MAX;
+    vm->dirtyPages = 0;
+}
+
+// Save the scratch VM back into p, taking a page for every image page it wrote
+void park (HostWorker* worker, Parked* p) {
+    Chip8* vm = worker->vm;
+
+    for (uint16_t pages = vm->dirtyPages; pages; pages &= pages - 1) {
+        unsigned page = __builtin_ctz(pages);
+        if (!p->pages[page]) {
+            p->pages[page] = takeFrom(&worker->pages);
+            p->owned      |= 1u << page;
+        }
+        memcpy(p->pages[page]->bytes, vm->ram + page * PAGE_BYTES, PAGE_BYTES);
+    }
+    worker->divergent = p->owned;
+
+    if (packable(&vm->display)) {
+        if (p->full) giveBack(&worker->displays, p->full);
+        p->full = nullptr;
+        for (unsigned y = 0; y < 32; y++) p->lores[y] = vm->display.rows[0][y][0];
+    } else {
+        if (!p->full) p->full = takeFrom(&worker->displays);
+        *p->full = vm->display;
+    }
+    p->planes = vm->display.planes;
+    memcpy(p->V, vm->V, sizeof(p->V));
+    memcpy(p->stack, vm->stack, sizeof(p->stack));
+    p->I       = vm->I;
+    p->PC      = vm->PC;
+    p->SP      = vm->SP;
+    p->dTimer  = vm->dTimer;
+    p->sTimer  = vm->sTimer;
+    p->keys    = vm->keys;
+    p->pressed = vm->pressed;
+    p->cycles  = vm->cycles;
+    p->rngAt   = vm->rng.at;
+    memcpy(p->rng, vm->rng.s, sizeof(p->rng));
+    if (p->rngAt < RANDOM_POOL) rewindRandom(p->rng);
+}
+
+// Run one 60 Hz tick of every instance the worker hosts
+void tickHosted (HostWorker* worker) {
+    for (Parked* p : worker->instances) {
+        resume(worker, p);
+        runInstructions(&worker->sched, worker->vm);
+        tickTimers(worker->vm);
+        park(worker, p);
+    }
+    worker->sched.ticks++;
+}
+
+// CHIP8 --host <rom> <instances> [frames] [workers]
+int runHost (const char* rom, uint64_t count, uint64_t frames, unsigned workers) {
+    HostImage* image = new HostImage;
+    if (!loadHostImage(rom, QUIRKS_CHIP8, image)) {
+        fprintf(stderr, "%s: cannot load ROM\n", rom);
+        return 1;
+    }
+    if (!workers) workers = thread::hardware_concurrency();
+    if (!workers) workers = 1;
+
+    vector<HostWorker> hosts(workers);
+    for (HostWorker& host : hosts) host.vm = new Chip8;
+    for (uint64_t i = 0; i < count; i++) {
+        HostWorker& host = hosts[i % workers];
+        host.instances.push_back(hostInstance(&host, image, 0, i));
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (HostWorker& host : hosts) {
+        pool.emplace_back([&host, frames] {
+            for (uint64_t f = 0; f < frames; f++) tickHosted(&host);
+        });
+    }
+    for (thread& t : pool) t.join();
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t pages = 0, displays = 0;
+    for (HostWorker& host : hosts) {
+        pages    += host.pages.used;
+        displays += host.displays.used;
+    }
+    double rate     = total > 0 ? count * frames / total : 0.0;
+    double privates = sizeof(Parked) + (double)(pages * sizeof(Page) + displays * sizeof(Display)) / (count ? count : 1);
+    printf("%llu instances, %llu frames, %u workers, %.3f s, %.0f instance frames/s (%.0f instances at 60 Hz)\n",
+           (unsigned long long)count, (unsigned long long)frames, workers, total, rate, rate / 60);
+    printf("private %.0f B per instance (%zu B parked, %zu pages, %zu full displays), shared %zu B image and %u x %zu B scratch VMs\n",
+           privates, sizeof(Parked), pages, displays, sizeof(HostImage), workers, sizeof(Chip8));
+    if (count) {
+        resume(&hosts[0], hosts[0].instances[0]);
+        printf("instance 0 PC=%03X hash=%016llx\n", hosts[0].vm->PC, (unsigned long long)displayHash(hosts[0].vm));
+    }
+
+    for (HostWorker& host : hosts) {
+        for (Parked* p : host.instances) releaseInstance(&host, p);
+        freePool(&host.parked);
+        freePool(&host.pages);
+        freePool(&host.displays);
+        delete host.vm;
+    }
+    delete image;
+    return 0;
+}
+
+#ifndef _WIN32
+/*
+    Frame streaming
+    --serve runs sessions of a ROM at 60 Hz and streams them over UDP to any
+    number of viewers, --watch is the matching terminal client. A viewer
+    subscribes to one session and from then on gets one datagram per tick:
+
+        u8 flags (STREAM_KEYFRAME, STREAM_HIRES) | varint seq
+        | per changed row: u8 y, then per plane and 64 pixel word (one word
+          in lores, two in hires): u8 mask, then the bytes the mask names
+
+    Each row is XORed against the frame before (against a blank frame in a
+    keyframe) and only the nonzero bytes of each word are sent, MSB first, bit
+    7 - b of the mask standing for byte b. A tick where nothing changed costs
+    two to four bytes. Viewers that see a gap in seq ask for a keyframe and drop
+    deltas until it arrives. On Linux each tick's datagrams for every viewer of
+    every session go out with a single sendmmsg().
+
+    Viewer to server:
+        'S' u16 session     subscribe, repeated every 2 s to stay subscribed
+        'K' u8 event        key change, key | KEY_DOWN for a press
+        'R'                 ask for a keyframe
+*/
+#define STREAM_PORT     "8008"
+#define STREAM_KEYFRAME 0x01
+#define STREAM_HIRES    0x02
+#define STREAM_PACKET   (1 + 10 + 64 * (1 + PLANES * 2 * 9))  // Every row of a hires frame
+#define STREAM_TIMEOUT  10   // Seconds of silence before a viewer is dropped
+#define STREAM_BATCH    256  // Datagrams per sendmmsg()
+
+uint8_t* putVarint (uint8_t* p, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) *p++ = (v & 0x7F) | 0x80;
+    *p++ = v;
+    return p;
+}
+
+// Append the XOR of rows a and b, masks and nonzero bytes per plane and word
+uint8_t* putRow (uint8_t* p, const uint64_t a[PLANES][2], const uint64_t b[PLANES][2], unsigned words) {
+    for (unsigned plane = 0; plane < PLANES; plane++) {
+        for (unsigned w = 0; w < words; w++) {
+            uint64_t x    = a[plane][w] ^ b[plane][w];
+            uint8_t* mask = p++;
+            *mask = 0;
+            for (unsigned i = 0; i < 8; i++) {
+                uint8_t byte = x >> (56 - 8 * i);
+                if (!byte) continue;
+                *mask |= 0x80 >> i;
+                *p++   = byte;
+            }
+        }
+    }
+    return p;
+}
+
+// Delta from `shown` to the rows in delta, which become the new `shown`.
+// Returns the datagram size.
+size_t encodeDelta (uint8_t* out, uint64_t seq, const FrameDelta* delta, uint64_t shown[64][PLANES][2]) {
+    uint8_t* p = out;
+    *p++ = delta->hires ? STREAM_HIRES : 0;
+    p    = putVarint(p, seq);
+    for (unsigned i = 0; i < delta->count; i++) {
+        unsigned y = delta->index[i];
+        *p++ = y;
+        p    = putRow(p, shown[y], delta->rows[i], delta->hires ? 2 : 1);
+        memcpy(shown[y], delta->rows[i], sizeof(delta->rows[i]));
+    }
+    return p - out;
+}
+
+// Every lit row of `shown`, against a blank frame
+size_t encodeKeyframe (uint8_t* out, uint64_t seq, bool hires, const uint64_t shown[64][PLANES][2]) {
+    static const uint64_t blank[PLANES][2] = {};
+    uint8_t* p = out;
+    *p++ = STREAM_KEYFRAME | (hires ? STREAM_HIRES : 0);
+    p    = putVarint(p, seq);
+    for (unsigned y = 0; y < (hires ? 64u : 32u); y++) {
+        if (!memcmp(shown[y], blank, sizeof(blank))) continue;
+        *p++ = y;
+        p    = putRow(p, blank, shown[y], hires ? 2 : 1);
+    }
+    return p - out;
+}
+
+// A viewer's copy of a session's display
+typedef struct StreamView {
+    uint64_t rows[64][PLANES][2] = {};
+    bool     hires  = false;
+    bool     synced = false;  // rows is frame `seq`, deltas can be applied
+    uint64_t seq    = 0;
+} StreamView;
+
+// Apply a frame datagram to view, setting *changed to the rows it touched.
+// Returns false for a malformed datagram or a delta that doesn't follow the
+// frame view holds; the view then waits for a keyframe.
+bool applyFrame (StreamView* view, const uint8_t* in, size_t size, uint64_t* changed) {
+    const uint8_t* p   = in;
+    const uint8_t* end = in + size;
+    uint64_t       seq;
+
+    *changed = 0;
+    if (p == end) return false;
+    uint8_t flags = *p++;
+    bool    hires = flags & STREAM_HIRES;
+    if (!getVarint(&p, end, &seq)) return false;
+    if (view->synced && seq <= view->seq) return true;  // Late or duplicated
+    if (!(flags & STREAM_KEYFRAME) && (!view->synced || seq != view->seq + 1 || hires != view->hires)) {
+        view->synced = false;
+        return false;
+    }
+
+    if (flags & STREAM_KEYFRAME) {
+        memset(view->rows, 0, sizeof(view->rows));
+        view->hires = hires;
+        *changed    = hires ? ~0ull : 0xFFFFFFFFull;
+    }
+    view->synced = false;
+    while (p < end) {
+        unsigned y = *p++;
+        if (y >= (hires ? 64u : 32u)) return false;
+        for (unsigned plane = 0; plane < PLANES; plane++) {
+            for (unsigned w = 0; w < (hires ? 2u : 1u); w++) {
+                if (p == end) return false;
+                uint8_t  mask = *p++;
+                uint64_t x    = 0;
+                for (unsigned i = 0; i < 8; i++) {
+                    if (!(mask & (0x80 >> i))) continue;
+                    if (p == end) return false;
+                    x |= (uint64_t)*p++ << (56 - 8 * i);
+                }
+                view->rows[y][plane][w] ^= x;
+            }
+        }
+        *changed |= 1ull << y;
+    }
+    view->seq    = seq;
+    view->synced = true;
+    return true;
+}
+
+// Consumer side of a Keypad without a VM: take the next queued event
+bool popKey (Keypad* pad, uint8_t* event) {
+    uint32_t tail = pad->tail.load(memory_order_relaxed);
+    if (tail == pad->head.load(memory_order_acquire)) return false;
+    *event = pad->events[tail % KEY_QUEUE];
+    pad->tail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+typedef struct StreamSession {
+    Chip8*    vm = nullptr;
+    Keypad    keypad;
+    Scheduler sched;
+    uint64_t  shown[64][PLANES][2] = {};  // Frame `seq`, as the viewers have it
+    uint64_t  seq     = 0;
+    bool      hires   = false;
+    bool      rekey   = false;            // Resolution changed, everyone gets a keyframe
+    uint8_t   delta[STREAM_PACKET];
+    size_t    deltaSize = 0;
+    uint8_t   key[STREAM_PACKET];
+    size_t    keySize   = 0;              // 0 until a viewer needs this tick's keyframe
+} StreamSession;
+
+typedef struct Viewer {
+    sockaddr_storage                 addr;
+    socklen_t                        len;
+    unsigned                         session;
+    bool                             resync;  // Send a keyframe next
+    chrono::steady_clock::time_point heard;
+} Viewer;
+
+typedef struct StreamServer {
+    int                              fd = -1;
+    vector<StreamSession*>           sessions;
+    vector<Viewer>                   viewers;
+    unordered_map<string, unsigned>  index;   // Viewer by address
+} StreamServer;
+
+void dropViewer (StreamServer* server, unsigned i) {
+    server->index.erase(string((const char*)&server->viewers[i].addr, server->viewers[i].len));
+    if (i + 1 != server->viewers.size()) {
+        server->viewers[i] = server->viewers.back();
+        server->index[string((const char*)&server->viewers[i].addr, server->viewers[i].len)] = i;
+    }
+    server->viewers.pop_back();
+}
+
+void handleDatagram (StreamServer* server, const uint8_t* in, size_t size, const sockaddr_storage* from, socklen_t len) {
+    string   key(( const char*)from, len);
+    auto     found  = server->index.find(key);
+    Viewer*  viewer = found != server->index.end() ? &server->viewers[found->second] : nullptr;
+    auto     now    = chrono::steady_clock::now();
+
+    if (size == 3 && in[0] == 'S') {
+        unsigned session = in[1] | (in[2] << 8);
+        if (session >= server->sessions.size()) return;
+        if (!viewer) {
+            server->index[key] = server->viewers.size();
+            server->viewers.push_back({ *from, len, session, true, now });
+            return;
+        }
+        viewer->resync |= viewer->session != session;
+        viewer->session = session;
+        viewer->heard   = now;
+        return;
+    }
+    if (!viewer) return;
+    viewer->heard = now;
+    if (size == 2 && in[0] == 'K') pushKey(&server->sessions[viewer->session]->keypad, in[1] & 0xF, in[1] & KEY_DOWN);
+    if (size == 1 && in[0] == 'R') viewer->resync = true;
+}
+
+// Take in everything the viewers sent since the last tick
+void receiveDatagrams (StreamServer* server) {
+    uint8_t          buf[16][64];
+    sockaddr_storage from[16];
+#ifdef __linux__
+    for (;;) {
+        mmsghdr msgs[16] = {};
+        iovec   iov[16];
+        for (unsigned i = 0; i < 16; i++) {
+            iov[i]                     = { buf[i], sizeof(buf[i]) };
+            msgs[i].msg_hdr.msg_iov     = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+            msgs[i].msg_hdr.msg_name    = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+        int n = recvmmsg(server->fd, msgs, 16, MSG_DONTWAIT, nullptr);
+        for (int i = 0; i < n; i++) handleDatagram(server, buf[i], msgs[i].msg_len, &from[i], msgs[i].msg_hdr.msg_namelen);
+        if (n < 16) return;
+    }
+#else
+    for (;;) {
+        socklen_t len = sizeof(from[0]);
+        ssize_t   n   = recvfrom(server->fd, buf[0], sizeof(buf[0]), MSG_DONTWAIT, (sockaddr*)&from[0], &len);
+        if (n < 0) return;
+        handleDatagram(server, buf[0], n, &from[0], len);
+    }
+#endif
+}
+
+// Queue, and when the batch is full send, one datagram
+void sendDatagram (StreamServer* server, const Viewer* viewer, const uint8_t* data, size_t size, bool flush) {
+#ifdef __linux__
+    static mmsghdr msgs[STREAM_BATCH];
+    static iovec   iov[STREAM_BATCH];
+    static unsigned queued = 0;
+
+    if (viewer) {
+        iov[queued]                     = { (void*)data, size };
+        msgs[queued].msg_hdr            = {};
+        msgs[queued].msg_hdr.msg_iov     = &iov[queued];
+        msgs[queued].msg_hdr.msg_iovlen  = 1;
+        msgs[queued].msg_hdr.msg_name    = (void*)&viewer->addr;
+        msgs[queued].msg_hdr.msg_namelen = viewer->len;
+        queued++;
+    }
+    if (queued < STREAM_BATCH && !flush) return;
+    for (unsigned sent = 0; sent < queued; ) {
+        int n = sendmmsg(server->fd, msgs + sent, queued - sent, 0);
+        if (n <= 0) break;  // Full socket buffer, the viewers will resync
+        sent += n;
+    }
+    queued = 0;
+#else
+    if (viewer) sendto(server->fd, data, size, 0, (const sockaddr*)&viewer->addr, viewer->len);
+#endif
+}
+
+// Run one tick of every session and stream the result
+void streamTick (StreamServer* server) {
+    for (StreamSession* s : server->sessions) {
+        runTick(&s->sched, s->vm);
+
+        FrameDelta delta;
+        presentFrame(s->vm, &delta);
+        s->seq++;
+        s->rekey     = delta.hires != s->hires;
+        s->hires     = delta.hires;
+        s->deltaSize = encodeDelta(s->delta, s->seq, &delta, s->shown);
+        s->keySize   = 0;
+    }
+
+    auto now = chrono::steady_clock::now();
+    for (unsigned i = 0; i < server->viewers.size(); ) {
+        Viewer* viewer = &server->viewers[i];
+        if (now - viewer->heard > chrono::seconds(STREAM_TIMEOUT)) {
+            dropViewer(server, i);
+            continue;
+        }
+
+        StreamSession* s = server->sessions[viewer->session];
+        if (viewer->resync || s->rekey) {
+            if (!s->keySize) s->keySize = encodeKeyframe(s->key, s->seq, s->hires, s->shown);
+            sendDatagram(server, viewer, s->key, s->keySize, false);
+            viewer->resync = false;
+        } else {
+            sendDatagram(server, viewer, s->delta, s->deltaSize, false);
+        }
+        i++;
+    }
+    sendDatagram(server, nullptr, nullptr, 0, true);
+}
+
+// UDP socket bound to port on all addresses, or connected to host:port
+int openSocket (const char* host, const char* port) {
+    addrinfo hints = {}, *found;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags    = host ? 0 : AI_PASSIVE;
+    if (getaddrinfo(host, port, &hints, &found) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if ((host ? connect(fd, a->ai_addr, a->ai_addrlen) : ::bind(fd, a->ai_addr, a->ai_addrlen)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+// CHIP8 --serve <rom> [port] [sessions]
+int runServer (const char* rom, const char* port, unsigned count) {
+    StreamServer server;
+    server.fd = openSocket(nullptr, port);
+    if (server.fd < 0) {
+        fprintf(stderr, "cannot open udp port %s\n", port);
+        return 1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        StreamSession* s = new StreamSession;
+        s->vm = new Chip8;
+        if (!initVM(s->vm, rom)) {
+            fprintf(stderr, "%s: cannot load ROM\n", rom);
+            return 1;
+        }
+        seedRandom(&s->vm->rng, 0, i);
+        s->vm->keypad = &s->keypad;
+        server.sessions.push_back(s);
+    }
+    printf("streaming %u sessions of %s on udp port %s\n", count, rom, port);
+
+    signal(SIGINT, [] (int) { stopRequested = 1; });
+    chrono::steady_clock::time_point next = chrono::steady_clock::now();
+    while (!stopRequested) {
+        receiveDatagrams(&server);
+        streamTick(&server);
+        waitTick(&next);
+    }
+
+    for (StreamSession* s : server.sessions) {
+        delete s->vm;
+        delete s;
+    }
+    close(server.fd);
+    return 0;
+}
+
+// CHIP8 --watch <host> [port] [session]
+int runViewer (const char* host, const char* port, unsigned session) {
+    int fd = openSocket(host, port);
+    if (fd < 0) {
+        fprintf(stderr, "cannot reach %s port %s\n", host, port);
+        return 1;
+    }
+    const uint8_t subscribe[3] = { 'S', (uint8_t)session, (uint8_t)(session >> 8) };
+    send(fd, subscribe, sizeof(subscribe), 0);
+
+    Keypad* keypad = new Keypad;
+    startTerminalInput(keypad);
+    signal(SIGINT, [] (int) { stopRequested = 1; });
+    printf("\x1b[2J\x1b[?25l");
+
+    StreamView view;
+    auto keepalive = chrono::steady_clock::now(), asked = keepalive;
+    while (!stopRequested) {
+        struct pollfd in = { fd, POLLIN, 0 };
+        poll(&in, 1, 1000 / TICK_HZ);
+
+        uint8_t packet[STREAM_PACKET];
+        ssize_t size;
+        while ((size = recv(fd, packet, sizeof(packet), MSG_DONTWAIT)) > 0) {
+            bool     hires = view.hires;
+            uint64_t changed;
+            if (!applyFrame(&view, packet, size, &changed)) {
+                auto now = chrono::steady_clock::now();
+                if (now - asked > chrono::milliseconds(100)) {
+                    send(fd, "R", 1, 0);
+                    asked = now;
+                }
+                continue;
+            }
+
+            FrameDelta delta = {};
+            delta.hires   = view.hires;
+            delta.resized = view.hires != hires;
+            for (; changed; changed &= changed - 1) {
+                unsigned y = __builtin_ctzll(changed);
+                memcpy(delta.rows[delta.count], view.rows[y], sizeof(view.rows[y]));
+                delta.index[delta.count++] = y;
+            }
+            if (delta.count) presentTerminal(nullptr, &delta, nullptr);
+        }
+
+        uint8_t event;
+        while (popKey(keypad, &event)) {
+            const uint8_t key[2] = { 'K', event };
+            send(fd, key, sizeof(key), 0);
+        }
+        if (chrono::steady_clock::now() - keepalive > chrono::seconds(2)) {
+            send(fd, subscribe, sizeof(subscribe), 0);
+            keepalive = chrono::steady_clock::now();
+        }
+    }
+    printf("\x1b[?25h\n");
+    close(fd);
+    return 0;
+}
+#endif
+
+#if CHIP8_GL
+/*
+    Grid viewer
+    Runs every ROM of a batch list at 60 Hz and shows them all in one window.
+    Instances are dealt round-robin to the workers; each worker ticks its own
+    instances and publishes their frames through a TripleBuffer, the main thread
+    uploads whatever frames are new and draws the grid. Neither side ever waits
+    on the other. An instance stops once it has run its cycle budget.
+*/
+typedef struct GridInstance {
+    Chip8*       vm = nullptr;
+    Scheduler    sched;
+    TripleBuffer frames;
+} GridInstance;
+
+int runGrid (const char* listfile, unsigned workers, int* argc, char** argv) {
+    vector<BatchJob> jobs = readBatchList(listfile);
+    if (jobs.empty()) {
+        fprintf(stderr, "no ROMs in %s\n", listfile);
+        return 1;
+    }
+    if (!workers) workers = thread::hardware_concurrency();
+    if (!workers) workers = 1;
+
+    vector<GridInstance> grid(jobs.size());
+    for (unsigned i = 0; i < jobs.size(); i++) {
+        GridInstance& g = grid[i];
+        g.vm = new Chip8;
+        if (!initVM(g.vm, jobs[i].rom.c_str())) {
+            fprintf(stderr, "%s: cannot load ROM\n", jobs[i].rom.c_str());
+            delete g.vm;
+            g.vm = nullptr;
+            continue;
+        }
+        if (jobs[i].jit) {
+            attachRecompiler(g.vm);
+            precompileROM(g.vm);
+        }
+        seedRandom(&g.vm->rng, 0, jobs[i].stream);
+        g.sched.present = presentShared;
+        g.sched.user    = &g.frames;
+    }
+
+    GLRenderer gl;
+    gl.layers = grid.size();
+    unsigned cols = 1;
+    while (cols * cols < gl.layers) cols++;
+    gl.width  = min(cols * 256u, 1920u);
+    gl.height = min((gl.layers + cols - 1) / cols * 128u, 1080u);
+    if (!initGL(&gl, argc, argv, listfile)) {
+        fprintf(stderr, "cannot set up OpenGL 4.4\n");
+        return 1;
+    }
+
+    atomic<bool> stop { false };
+    vector<thread> pool;
+    for (unsigned w = 0; w < workers && w < grid.size(); w++) {
+        pool.emplace_back([&, w] {
+            chrono::steady_clock::time_point next = chrono::steady_clock::now();
+            while (!stop.load(memory_order_relaxed)) {
+                for (unsigned i = w; i < grid.size(); i += workers) {
+                    GridInstance& g = grid[i];
+                    if (g.vm && g.sched.ticks * g.sched.ipf < jobs[i].budget) runTick(&g.sched, g.vm);
+                }
+                waitTick(&next);
+            }
+        });
+    }
+
+    chrono::steady_clock::time_point next = chrono::steady_clock::now();
+    while (!gl.closed) {
+        glutMainLoopEvent();
+        beginUploadGL(&gl);
+        for (unsigned i = 0; i < grid.size(); i++) {
+            const SharedFrame* frame = takeFrame(&grid[i].frames);
+            if (!frame) continue;
+
+            FrameDelta delta;
+            delta.mask    = frame->mask;
+            delta.count   = 0;
+            delta.hires   = frame->hires;
+            delta.resized = false;
+            for (uint64_t m = frame->mask; m; m &= m - 1) {
+                unsigned y = __builtin_ctzll(m);
+                for (unsigned p = 0; p < PLANES; p++) {
+                    delta.rows[delta.count][p][0] = frame->rows[p][y][0];
+                    delta.rows[delta.count][p][1] = frame->rows[p][y][1];
+                }
+                delta.index[delta.count++] = y;
+            }
+            uploadGL(&gl, i, &delta);
+        }
+        endUploadGL(&gl);
+        drawGL(&gl);
+        waitTick(&next);
+    }
+
+    stop = true;
+    for (thread& t : pool) t.join();
+    for (GridInstance& g : grid) {
+        if (!g.vm) continue;
+        detachRecompiler(g.vm);
+        delete g.vm;
+    }
+    return 0;
+}
+#endif
+
+/*
+    Micro-benchmarks
+    Times every dispatch backend on two kinds of workload:
+
+      - One synthetic kernel per INSTRUCTION_LIST entry: a loop of 64 copies of
+        the opcode with operands filled from its pattern (x = V1, y = V2, kk = 01,
+        n = 5), so every mnemonic is covered as the list grows. Jumps and calls
+        target the next instruction, 00EE runs inside a CALL / JP / RET triple,
+        and LD Vx, K is skipped as it waits for input.
+      - Real ROMs, restored from a checkpoint whenever they halt.
+
+    Results are instructions/s, ns per instruction and, where the kernel lets us
+    open a hardware counter, cache misses. --csv prints them as
+    backend,workload,instructions,seconds,ips,ns_per_op,cache_misses
+*/
+typedef unsigned (*Backend)(Chip8* vm);
+
+// The original if/else chain: a linear walk of INSTRUCTION_LIST per instruction
+unsigned runChain (Chip8* vm) {
+    fetch(vm);
+    lookup(vm->instr)(vm, (vm->instr & Vx) >> 8, (vm->instr & Vy) >> 4,
+                      vm->instr & N, vm->instr & NN, vm->instr & NNN);
+    return 1;
+}
+
+unsigned runTable (Chip8* vm) {
+    fetch(vm);
+    decode(vm);
+    return 1;
+}
+
+unsigned runCached (Chip8* vm) {
+    uint64_t cycles = vm->cycles;
+    step(vm);
+    return vm->cycles - cycles;
+}
+
+typedef struct BenchBackend {
+    const char* name;
+    Backend     run;
+    bool        jit;
+} BenchBackend;
+
+const BenchBackend backends[] = {
+    { "chain", runChain,  false },
+    { "table", runTable,  false },
+    { "cache", runCached, false },
+    { "jit",   runBlock,  true  },
+};
+
+// Build the synthetic kernel for an opcode pattern such as "8xy4" at 0x200,
+// returns its size in bytes or 0 if the opcode can't be benchmarked in a loop
+size_t buildKernel (const char* pattern, uint8_t* rom) {
+    if (strcmp(pattern, "Fx0A") == 0) return 0;
+
+    bool     address = strstr(pattern, "nnn") != nullptr;
+    unsigned instr   = 0;
+    for (unsigned i = 0; i < 4; i++) {
+        char     c = pattern[i];
+        unsigned v = 0;
+        if      (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+        else if (c == 'x')             v = 1;
+        else if (c == 'y')             v = 2;
+        else if (c == 'k')             v = i == 3 ? 1 : 0;
+        else if (c == 'n')             v = address ? 0 : 5;
+        instr = (instr << 4) | v;
+    }
+
+    vector<uint16_t> code;
+    code.push_back(0xA000);                                 // I = 0, keeps Fx55 / Fx33 out of the program
+    for (unsigned i = 0; i < 64; i++) {
+        unsigned next = 0x200 + 2 * (code.size() + 1);
+        if (instr == 0x00EE) {
+            code.push_back(0x2000 | (next + 2));            // CALL the RET below
+            code.push_back(0x1000 | (next + 4));            // Step over it on return
+            code.push_back(0x00EE);
+        } else if (address && (instr >> 12 == 0x1 || instr >> 12 == 0x2 || instr >> 12 == 0xB)) {
+            code.push_back((instr & OP) | next);
+        } else {
+            code.push_back(instr);
+        }
+    }
+    code.push_back(0x1200);                                 // Twice, in case a skip
+    code.push_back(0x1200);                                 // lands on the first
+
+    for (unsigned i = 0; i < code.size(); i++) {
+        rom[2 * i]     = code[i] >> 8;
+        rom[2 * i + 1] = code[i] & 0xFF;
+    }
+    return 2 * code.size();
+}
+
+int openCacheMissCounter () {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+typedef struct BenchResult {
+    uint64_t instructions;
+    double   seconds;
+    long long misses;   // -1 when no counter is available
+} BenchResult;
+
+// Run vm for `cycles` instructions on one backend, restoring `start` whenever it halts
+BenchResult benchRun (const BenchBackend* backend, Chip8* vm, uint64_t cycles) {
+    Snapshot* start = new Snapshot;
+    checkpoint(vm, start);
+    if (backend->jit) attachRecompiler(vm);
+
+    BenchResult r = { 0, 0, -1 };
+    int counter = openCacheMissCounter();
+#ifdef __linux__
+    if (counter >= 0) { ioctl(counter, PERF_EVENT_IOC_RESET, 0); ioctl(counter, PERF_EVENT_IOC_ENABLE, 0); }
+#endif
+    auto begin = chrono::steady_clock::now();
+    while (r.instructions < cycles) {
+        if (halted(vm)) restoreSnapshot(vm, start);
+        r.instructions += backend->run(vm);
+    }
+    r.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+#ifdef __linux__
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &r.misses, sizeof(r.misses)) != sizeof(r.misses)) r.misses = -1;
+        close(counter);
+    }
+#endif
+    detachRecompiler(vm);
+    delete start;
+    return r;
+}
+
+void benchReport (const char* backend, const char* workload, const BenchResult& r, bool csv) {
+    double ips = r.seconds > 0 ? r.instructions / r.seconds : 0;
+    double ns  = r.instructions ? r.seconds * 1e9 / r.instructions : 0;
+    if (csv) {
+        printf("%s,%s,%llu,%.6f,%.0f,%.3f,%lld\n", backend, workload,
+               (unsigned long long)r.instructions, r.seconds, ips, ns, r.misses);
+    } else if (r.misses >= 0) {
+        printf("%-6s %-28s %14.0f ips %8.2f ns/op %12lld misses\n", backend, workload, ips, ns, r.misses);
+    } else {
+        printf("%-6s %-28s %14.0f ips %8.2f ns/op %12s misses\n", backend, workload, ips, ns, "n/a");
+    }
+}
+
+// CHIP8 --bench [--csv] [--cycles n] [rom ...]
+int runBench (int argc, char** argv) {
+    bool     csv    = false;
+    uint64_t cycles = 2000000;
+    vector<const char*> roms;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--csv") == 0) csv = true;
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) cycles = strtoull(argv[++i], nullptr, 10);
+        else roms.push_back(argv[i]);
+    }
+    if (csv) printf("backend,workload,instructions,seconds,ips,ns_per_op,cache_misses\n");
+
+    Chip8* vm = new Chip8;
+    uint8_t kernel[ROM_MAX];
+    for (const BenchBackend& backend : backends) {
+        for (unsigned i = 0; i < instructionCount; i++) {
+            size_t size = buildKernel(instructions[i].opcode, kernel);
+            if (!size) continue;
+
+            *vm = Chip8();
+            vm->PC = 0x200;
+            memcpy(vm->ram + 0x200, kernel, size);
+            invalidate(vm, 0x200, size);
+
+            string name = string(instructions[i].opcode) + " " + instructions[i].mnemonic;
+            benchReport(backend.name, name.c_str(), benchRun(&backend, vm, cycles), csv);
+        }
+        for (const char* rom : roms) {
+            *vm = Chip8();
+            if (!initVM(vm, rom)) {
+                fprintf(stderr, "%s: cannot load ROM\n", rom);
+                continue;
+            }
+            benchReport(backend.name, rom, benchRun(&backend, vm, cycles), csv);
+        }
+    }
+    delete vm;
+    return 0;
+}
+
+/*
+    Differential testing
+    --diff runs one ROM on two backends side by side, tick by tick the way the
+    headless runner does, with the same seed or input trace. At the end of the
+    first tick past every `every` instructions, and when the program halts, each
+    side is boiled down to a digest: its instruction count, a hash of V, I, PC,
+    SP, the stack and the timers, one of ram and the display hash. Sides that
+    agree are checkpointed there. On the first mismatch both are rewound to
+    the last checkpoint and the gap is bisected, rerunning each side from its
+    checkpoint to a given instruction count, down to the first instruction
+    after which they differ.
+
+    Backends are chain, table, cache and jit. The jit stops exactly at the
+    instruction asked for, mid block if need be, so a probe runs the same
+    translated code the full run did.
+*/
+typedef enum DiffBackend {
+    DIFF_CHAIN,
+    DIFF_TABLE,
+    DIFF_CACHE,
+    DIFF_JIT,
+} DiffBackend;
+
+const char* const diffBackends[] = { "chain", "table", "cache", "jit" };
+constexpr unsigned diffBackendCount = sizeof(diffBackends) / sizeof(diffBackends[0]);
+
+typedef struct DiffSide {
+    DiffBackend  backend;
+    QuirkProfile quirks;
+    Chip8*       vm = nullptr;
+} DiffSide;
+
+// A side as of a checkpoint
+typedef struct DiffMark {
+    Snapshot    snap;
+    uint64_t    cycles  = 0;
+    uint16_t    keys    = 0;
+    uint16_t    pressed = 0;
+    size_t      next    = 0;        // Trace position
+} DiffMark;
+
+typedef struct DiffDigest {
+    uint64_t cycles, state, ram, display;
+} DiffDigest;
+
+uint64_t fnv1a (const void* data, size_t size, uint64_t hash = 0xCBF29CE484222325ull) {
+    for (size_t i = 0; i < size; i++) hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+bool openSide (DiffSide* side, const char* rom, DiffBackend backend, QuirkProfile quirks, uint64_t seed, const char* replay) {
+    side->backend = backend;
+    side->quirks  = quirks;
+    side->vm      = new Chip8;
+    if (!initVM(side->vm, rom)) return false;
+    useQuirks(side->vm, quirks);
+    seedRandom(&side->vm->rng, seed, 0);
+
+    if (replay) {
+        side->vm->trace = new Trace;
+        if (!loadTrace(side->vm->trace, replay) || side->vm->trace->program != programHash(side->vm)) return false;
+    }
+    if (backend == DIFF_JIT) {
+        attachRecompiler(side->vm);
+        precompileROM(side->vm);
+    }
+    return true;
+}
+
+void closeSide (DiffSide* side) {
+    if (!side->vm) return;
+    detachRecompiler(side->vm);
+    delete side->vm->trace;
+    delete side->vm;
+}
+
+// Execute at least one instruction and none at or past `end` instructions
+void diffStep (DiffSide* side, uint64_t end) {
+    Chip8* vm = side->vm;
+    vm->deadline = end;
+    switch (side->backend) {
+        case DIFF_CHAIN: {
+            fetch(vm);
+            vm->cycles++;
+            Handler exec = side->quirks == QUIRKS_SCHIP  ? lookup<QuirksSchip>(vm->instr)
+                         : side->quirks == QUIRKS_XOCHIP ? lookup<QuirksXOChip>(vm->instr)
+                                                         : lookup<QuirksChip8>(vm->instr);
+            exec(vm, (vm->instr & Vx) >> 8, (vm->instr & Vy) >> 4, vm->instr & N, vm->instr & NN, vm->instr & NNN);
+            break;
+        }
+        case DIFF_TABLE:
+            fetch(vm);
+            vm->cycles++;
+            decode(vm);
+            break;
+        case DIFF_CACHE:
+            step(vm);
+            break;
+        case DIFF_JIT:
+            runBlock(vm);
+            break;
+    }
+}
+
+// Run tick `tick` as the headless runner would: the keys due, up to ipf
+// instructions or until the VM waits, the timers, and any wake the trace has
+// for the VM's wait. Stops short once `target` instructions have run and
+// returns false if it did.
+bool runDiffTick (DiffSide* side, uint64_t tick, unsigned ipf, uint64_t target) {
+    Chip8*   vm  = side->vm;
+    uint64_t end = vm->cycles + ipf;  // Wakes share the tick's budget
+    for (bool wake = false; ; wake = true) {
+        vm->waiting = false;
+        if (vm->cycles < end) {
+            if (vm->trace) {
+                vm->trace->now = tick + wake;
+                if (vm->trace->replay) replayKeys(vm);
+            }
+            uint64_t stop = min(end, target);
+            while (vm->cycles < stop && !vm->waiting) diffStep(side, stop);
+            if (!vm->waiting && vm->cycles < end) return false;
+        }
+
+        if (!wake) tickTimers(vm);
+        if (!vm->waiting || !replayWake(vm, tick + 1)) return true;
+    }
+}
+
+DiffDigest diffDigest (DiffSide* side) {
+    Chip8*     vm = side->vm;
+    DiffDigest d;
+    d.cycles  = vm->cycles;
+    d.state   = fnv1a(vm->V, sizeof(vm->V));
+    d.state   = fnv1a(&vm->I, sizeof(vm->I), d.state);
+    d.state   = fnv1a(&vm->PC, sizeof(vm->PC), d.state);
+    d.state   = fnv1a(&vm->SP, sizeof(vm->SP), d.state);
+    d.state   = fnv1a(vm->stack, sizeof(vm->stack), d.state);
+    d.state   = fnv1a(&vm->dTimer, sizeof(vm->dTimer), d.state);
+    d.state   = fnv1a(&vm->sTimer, sizeof(vm->sTimer), d.state);
+    d.ram     = fnv1a(vm->ram, sizeof(vm->ram));
+    d.display = displayHash(&vm->display);
+    return d;
+}
+
+bool sameDigest (const DiffDigest& a, const DiffDigest& b) {
+    return a.cycles == b.cycles && a.state == b.state && a.ram == b.ram && a.display == b.display;
+}
+
+void takeMark (DiffSide* side, DiffMark* mark) {
+    Chip8* vm = side->vm;
+    checkpoint(vm, &mark->snap);
+    mark->keys    = vm->keys;
+    mark->pressed = vm->pressed;
+    mark->next    = vm->trace ? vm->trace->next : 0;
+    mark->cycles  = vm->cycles;
+}
+
+void restoreMark (DiffSide* side, const DiffMark* mark) {
+    Chip8* vm = side->vm;
+    restoreSnapshot(vm, &mark->snap);
+    vm->keys    = mark->keys;
+    vm->pressed = mark->pressed;
+    if (vm->trace) vm->trace->next = mark->next;
+    vm->cycles  = mark->cycles;
+    vm->waiting = false;
+}
+
+// Rewind side to its checkpoint from the start of tick `tick` and run it to
+// `target` instructions, or to the end of tick `last`
+void rerunSide (DiffSide* side, const DiffMark* mark, uint64_t tick, uint64_t last, unsigned ipf, uint64_t target) {
+    restoreMark(side, mark);
+    for (; tick <= last && side->vm->cycles < target; tick++) {
+        if (!runDiffTick(side, tick, ipf, target)) break;
+    }
+}
+
+// Print the fields of two VMs that don't match
+void printDifferences (const char* name[2], Chip8* a, Chip8* b) {
+    auto field = [&](const char* what, uint64_t x, uint64_t y, const char* format) {
+        if (x == y) return;
+        char left[24], right[24];
+        snprintf(left, sizeof(left), format, (unsigned long long)x);
+        snprintf(right, sizeof(right), format, (unsigned long long)y);
+        printf("    %-8s%-6s%s\n", what, left, right);
+    };
+    char label[16];
+    printf("    %-8s%-6s%s\n", "", name[0], name[1]);
+    field("cycles", a->cycles, b->cycles, "%llu");
+    for (unsigned r = 0; r < 16; r++) {
+        snprintf(label, sizeof(label), "V%X", r);
+        field(label, a->V[r], b->V[r], "%02llX");
+    }
+    field("I", a->I, b->I, "%03llX");
+    field("PC", a->PC, b->PC, "%03llX");
+    field("SP", a->SP, b->SP, "%llu");
+    for (unsigned i = 0; i < 16; i++) {
+        snprintf(label, sizeof(label), "stack%u", i);
+        field(label, a->stack[i], b->stack[i], "%03llX");
+    }
+    field("DT", a->dTimer, b->dTimer, "%02llX");
+    field("ST", a->sTimer, b->sTimer, "%02llX");
+
+    unsigned bytes = 0, first = 0;
+    for (unsigned addr = 0; addr < 4096; addr++) {
+        if (a->ram[addr] == b->ram[addr]) continue;
+        if (!bytes++) first = addr;
+    }
+    if (bytes) printf("    ram     %u bytes differ, the first at %03X: %02X  %02X\n", bytes, first, a->ram[first], b->ram[first]);
+    if (displayHash(&a->display) != displayHash(&b->display)) printf("    display differs\n");
+}
+
+typedef struct DiffOptions {
+    uint64_t     cycles = 1000000;
+    uint64_t     ticks  = 0;        // Stop after this many ticks too, the length of the trace
+    uint64_t     every  = 1000;
+    unsigned     ipf    = 11;
+    uint64_t     seed   = 0;
+    QuirkProfile quirks = QUIRKS_CHIP8;
+    const char*  replay = nullptr;
+} DiffOptions;
+
+// Run `a` and `b` in lockstep, returns true if they agreed throughout
+bool diffPair (const char* rom, DiffBackend a, DiffBackend b, const DiffOptions* opt) {
+    const char* name[2] = { diffBackends[a], diffBackends[b] };
+    DiffSide    side[2];
+    DiffMark*   mark = new DiffMark[2];
+    bool        same = true;
+    if (!openSide(&side[0], rom, a, opt->quirks, opt->seed, opt->replay) ||
+        !openSide(&side[1], rom, b, opt->quirks, opt->seed, opt->replay)) {
+        fprintf(stderr, "%s: cannot load ROM or trace\n", rom);
+        same = false;
+    }
+
+    uint64_t tick = 0, marked = 0, check = opt->every;
+    for (unsigned s = 0; same && s < 2; s++) takeMark(&side[s], &mark[s]);
+    while (same) {
+        runDiffTick(&side[0], tick, opt->ipf, UINT64_MAX);
+        runDiffTick(&side[1], tick, opt->ipf, UINT64_MAX);
+        tick++;
+
+        bool stop = halted(side[0].vm) && halted(side[1].vm);
+        bool end  = stop || side[0].vm->cycles >= opt->cycles || (opt->ticks && tick >= opt->ticks);
+        if (side[0].vm->cycles < check && !end) continue;
+        check = side[0].vm->cycles + opt->every;
+
+        if (sameDigest(diffDigest(&side[0]), diffDigest(&side[1]))) {
+            for (unsigned s = 0; s < 2; s++) takeMark(&side[s], &mark[s]);
+            marked = tick;
+            if (end) break;
+            continue;
+        }
+
+        // The sides agree at instruction lo and differ by hi, find the first
+        // instruction count where they don't
+        uint64_t last = tick - 1;
+        uint64_t lo   = mark[0].cycles;
+        uint64_t hi   = max(side[0].vm->cycles, side[1].vm->cycles);
+        while (hi - lo > 1) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            for (unsigned s = 0; s < 2; s++) rerunSide(&side[s], &mark[s], marked, last, opt->ipf, mid);
+            if (sameDigest(diffDigest(&side[0]), diffDigest(&side[1]))) lo = mid;
+            else                                                        hi = mid;
+        }
+
+        for (unsigned s = 0; s < 2; s++) rerunSide(&side[s], &mark[s], marked, last, opt->ipf, lo);
+        Chip8*   before = side[0].vm;
+        unsigned pc     = before->PC & 0xFFF;
+        char16_t instr  = (before->ram[pc] << 8) | before->ram[(pc + 1) & 0xFFF];
+        char     text[32];
+        disassemble(text, sizeof(text), instr);
+        printf("%s vs %s: diverged at instruction %llu\n", name[0], name[1], (unsigned long long)lo + 1);
+        printf("    %03X  %04X  %s\n", pc, instr, text);
+
+        for (unsigned s = 0; s < 2; s++) rerunSide(&side[s], &mark[s], marked, last, opt->ipf, lo + 1);
+        printDifferences(name, side[0].vm, side[1].vm);
+        same = false;
+    }
+    if (same) {
+        printf("%s vs %s: %llu instructions in %llu ticks, no difference\n", name[0], name[1],
+               (unsigned long long)side[0].vm->cycles, (unsigned long long)tick);
+    }
+
+    for (unsigned s = 0; s < 2; s++) closeSide(&side[s]);
+    delete[] mark;
+    return same;
+}
+
+// CHIP8 --diff <rom> [--backends list] [--cycles n] [--every n] [--ipf n] [--quirks profile] [--seed n] [--replay trace]
+int diffMain (int argc, char** argv) {
+    DiffOptions opt;
+    const char* rom  = nullptr;
+    string      list = "chain,table,cache,jit";
+    bool        bad  = false;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--backends") == 0 && i + 1 < argc)    list = argv[++i];
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) opt.cycles = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--every") == 0 && i + 1 < argc)  opt.every  = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)    opt.ipf    = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)   opt.seed   = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) opt.replay = argv[++i];
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) bad |= !parseQuirks(argv[++i], &opt.quirks);
+        else rom = argv[i];
+    }
+
+    // The first backend listed is the reference for the others
+    vector<DiffBackend> backends;
+    for (size_t at = 0; at <= list.size(); ) {
+        size_t   comma = min(list.find(',', at), list.size());
+        string   name  = list.substr(at, comma - at);
+        unsigned b     = 0;
+        while (b < diffBackendCount && name != diffBackends[b]) b++;
+        if (b == diffBackendCount) bad = true;
+        else backends.push_back((DiffBackend)b);
+        at = comma + 1;
+    }
+    if (!rom || bad || !opt.ipf || !opt.every || backends.size() < 2) {
+        fprintf(stderr, "usage: --diff <rom> [--backends chain,table,cache,jit] [--cycles n] [--every n] [--ipf n] [--quirks profile] [--seed n] [--replay trace]\n");
+        return 1;
+    }
+    if (opt.replay) {
+        Trace trace;
+        if (!loadTrace(&trace, opt.replay)) {
+            fprintf(stderr, "%s: cannot read trace\n", opt.replay);
+            return 1;
+        }
+        opt.ipf    = trace.ipf;
+        opt.quirks = trace.quirks;
+        opt.ticks  = trace.ticks;
+    }
+
+    bool same = true;
+    for (size_t i = 1; i < backends.size(); i++) same &= diffPair(rom, backends[0], backends[i], &opt);
+    return same ? 0 : 1;
+}
+
+/*
+    Fuzzer
+    --fuzz searches for key input that reaches new code. The corpus holds states,
+    each a snapshot plus the keys that led to it from power-on, starting with
+    the power-on state itself. Every worker repeatedly restores a corpus state
+    and plays a random stretch of input from it: held keys, each for a random
+    number of ticks, one tick run exactly as runTick() would. Restoring copies
+    back only the bytes that differ, so the translated blocks mostly survive the
+    restore and each attempt runs on the recompiler.
+
+    runBlock() counts the instructions each attempt executes per PC. A count
+    falls into one of eight buckets (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)
+    and an attempt that sets a (PC, bucket) bit no attempt has set before adds
+    its final state to the corpus. A new bucket means new behaviour even where
+    the code was already seen: another level, more enemies, the game over screen.
+
+    Attempts from the newest states are favoured, so the search keeps pushing
+    forward. The deepest state found can be written out as an input trace for
+    --headless --replay.
+*/
+#define FUZZ_CORPUS 8192   // Most states kept
+#define FUZZ_SPANS  8      // Most held keys per attempt
+
+typedef struct FuzzEntry {
+    const FuzzEntry* parent;   // State this one was reached from, nullptr at power-on
+    vector<uint16_t> keys;     // Keys held during each tick from the parent's state
+    uint64_t         ticks;    // From power-on
+    uint16_t         held;     // Keys held at the end
+    Snapshot         snap;
+} FuzzEntry;
+
+typedef struct Fuzzer {
+    const char*       rom;
+    QuirkProfile      quirks  = QUIRKS_CHIP8;
+    unsigned          ipf     = 11;
+    unsigned          span    = 120;   // Most ticks an attempt plays
+    uint64_t          seed    = 0;
+    mutex             lock;
+    vector<FuzzEntry*> corpus;
+    atomic<uint8_t>   seen[2048];      // Buckets hit, bit b for bucket b, per instruction slot
+    atomic<uint64_t>  runs         { 0 };
+    atomic<uint64_t>  instructions { 0 };
+    atomic<bool>      stopping     { false };
+} Fuzzer;
+
+unsigned hitBucket (uint32_t hits) {
+    return hits <= 3 ? hits - 1 : hits < 8 ? 3 : hits < 16 ? 4 : hits < 32 ? 5 : hits < 128 ? 6 : 7;
+}
+
+// A new VM for the fuzzer's ROM and settings, at power-on
+Chip8* fuzzVM (const Fuzzer* fuzz) {
+    Chip8* vm = new Chip8;
+    if (!initVM(vm, fuzz->rom)) {
+        delete vm;
+        return nullptr;
+    }
+    useQuirks(vm, fuzz->quirks);
+    seedRandom(&vm->rng, fuzz->seed, 0);
+    return vm;
+}
+
+// Run one tick with `keys` held, after `held` the tick before
+void fuzzTick (Scheduler* sched, Chip8* vm, uint16_t keys, uint16_t held) {
+    vm->keys    = keys;
+    vm->pressed = keys & ~held;
+    runTick(sched, vm);
+}
+
+void fuzzWorker (Fuzzer* fuzz, unsigned worker) {
+    Chip8* vm = fuzzVM(fuzz);
+    attachRecompiler(vm);
+    precompileROM(vm);
+
+    Random rng;
+    seedRandom(&rng, fuzz->seed, 1 + worker);
+    auto random = [&rng](unsigned range) { return (unsigned)(nextRandom(&rng) | nextRandom(&rng) << 8 | nextRandom(&rng) << 16) % range; };
+
+    uint32_t* hits = new uint32_t[2048]();
+    Scheduler sched;
+    sched.ipf       = fuzz->ipf;
+    sched.throttled = false;
+    vm->hits        = hits;
+
+    vector<uint16_t> keys;
+    while (!fuzz->stopping.load(memory_order_relaxed)) {
+        // Half the attempts start from one of the 32 newest states
+        const FuzzEntry* from;
+        {
+            lock_guard<mutex> guard(fuzz->lock);
+            size_t size = fuzz->corpus.size();
+            from = fuzz->corpus[random(2) ? size - 1 - random(min<size_t>(size, 32)) : random(size)];
+        }
+        restoreSnapshot(vm, &from->snap);
+
+        // Each span holds no key, or one, or now and then two, for 1 to 32 ticks
+        keys.clear();
+        unsigned length = 1 + random(fuzz->span);
+        for (unsigned s = 0; s < FUZZ_SPANS && keys.size() < length; s++) {
+            unsigned choice = random(20);
+            uint16_t mask   = choice < 3 ? 0 : 1u << random(16);
+            if (choice == 19) mask |= 1u << random(16);
+            keys.insert(keys.end(), min<size_t>(1 + random(32), length - keys.size()), mask);
+        }
+
+        uint64_t cycles = vm->cycles;
+        uint16_t held   = from->held;
+        size_t   played = 0;
+        while (played < keys.size() && !halted(vm)) {
+            fuzzTick(&sched, vm, keys[played], held);
+            held = keys[played++];
+        }
+        fuzz->runs.fetch_add(1, memory_order_relaxed);
+        fuzz->instructions.fetch_add(vm->cycles - cycles, memory_order_relaxed);
+
+        bool found = false;
+        for (unsigned slot = 0; slot < 2048; slot++) {
+            if (!hits[slot]) continue;
+            uint8_t bit = 1u << hitBucket(hits[slot]);
+            hits[slot]  = 0;
+            if (fuzz->seen[slot].load(memory_order_relaxed) & bit) continue;
+            found |= !(fuzz->seen[slot].fetch_or(bit, memory_order_relaxed) & bit);
+        }
+        if (!found || !played) continue;
+
+        FuzzEntry* entry = new FuzzEntry;
+        entry->parent = from;
+        entry->keys.assign(keys.begin(), keys.begin() + played);
+        entry->ticks  = from->ticks + played;
+        entry->held   = held;
+        takeSnapshot(vm, &entry->snap);
+        lock_guard<mutex> guard(fuzz->lock);
+        if (fuzz->corpus.size() < FUZZ_CORPUS) fuzz->corpus.push_back(entry);
+        else                                   delete entry;
+    }
+
+    vm->hits = nullptr;
+    delete[] hits;
+    detachRecompiler(vm);
+    delete vm;
+}
+
+// Play entry's keys from power-on through a keypad, recording an input trace.
+// Returns the display hash the replay ends on.
+uint64_t recordEntry (const Fuzzer* fuzz, const FuzzEntry* entry, Trace* trace) {
+    vector<uint16_t> keys;
+    for (const FuzzEntry* e = entry; e; e = e->parent) keys.insert(keys.begin(), e->keys.begin(), e->keys.end());
+
+    Chip8*  vm     = fuzzVM(fuzz);
+    Keypad* keypad = new Keypad;
+    Scheduler sched;
+    sched.ipf       = fuzz->ipf;
+    sched.throttled = false;
+    trace->ipf      = fuzz->ipf;
+    trace->quirks   = fuzz->quirks;
+    trace->program  = programHash(vm);
+    vm->trace       = trace;
+    vm->keypad      = keypad;
+
+    uint16_t held = 0;
+    for (uint16_t k : keys) {
+        for (unsigned key = 0; key < 16; key++) {
+            if (((held ^ k) >> key) & 1) pushKey(keypad, key, (k >> key) & 1);
+        }
+        runTick(&sched, vm);
+        held = k;
+    }
+    trace->ticks  = sched.ticks;
+    uint64_t hash = displayHash(vm);
+    vm->trace = nullptr;
+    delete vm;
+    delete keypad;
+    return hash;
+}
+
+// CHIP8 --fuzz <rom> [--seconds n] [--workers n] [--span ticks] [--ipf n] [--quirks profile] [--seed n] [--trace file]
+int fuzzMain (int argc, char** argv) {
+    Fuzzer*     fuzz    = new Fuzzer;
+    const char* record  = nullptr;
+    double      seconds = 10;
+    unsigned    workers = max(1u, thread::hardware_concurrency());
+    bool        bad     = false;
+    fuzz->rom = nullptr;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)      seconds    = atof(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers    = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--span") == 0 && i + 1 < argc)    fuzz->span = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)     fuzz->ipf  = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)    fuzz->seed = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)   record     = argv[++i];
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)  bad |= !parseQuirks(argv[++i], &fuzz->quirks);
+        else fuzz->rom = argv[i];
+    }
+    if (!fuzz->rom || bad || !workers || !fuzz->ipf || !fuzz->span) {
+        fprintf(stderr, "usage: --fuzz <rom> [--seconds n] [--workers n] [--span ticks] [--ipf n] [--quirks profile] [--seed n] [--trace file]\n");
+        return 1;
+    }
+
+    Chip8* vm = fuzzVM(fuzz);
+    if (!vm) {
+        fprintf(stderr, "%s: cannot load ROM\n", fuzz->rom);
+        return 1;
+    }
+    ROMMap* map = new ROMMap;
+    analyzeROM(vm->ram, map);
+    unsigned reachable = 0;
+    for (unsigned a = 0; a < 4096; a += 2) reachable += (map->flags[a] & MAP_INSTR) != 0;
+
+    FuzzEntry* root = new FuzzEntry;
+    root->parent = nullptr;
+    root->ticks  = 0;
+    root->held   = 0;
+    takeSnapshot(vm, &root->snap);
+    fuzz->corpus.push_back(root);
+    for (unsigned slot = 0; slot < 2048; slot++) fuzz->seen[slot] = 0;
+    delete vm;
+
+    vector<thread> threads;
+    for (unsigned w = 0; w < workers; w++) threads.emplace_back(fuzzWorker, fuzz, w);
+
+    // A status line a second
+    signal(SIGINT, [] (int) { stopRequested = 1; });
+    auto start = chrono::steady_clock::now();
+    auto covered = [&]() {
+        unsigned n = 0;
+        for (unsigned slot = 0; slot < 2048; slot++) n += fuzz->seen[slot].load(memory_order_relaxed) != 0;
+        return n;
+    };
+    auto deepest = [&]() {
+        lock_guard<mutex> guard(fuzz->lock);
+        const FuzzEntry* best = root;
+        for (const FuzzEntry* e : fuzz->corpus) if (e->ticks > best->ticks) best = e;
+        return best;
+    };
+    for (double at = 1; !stopRequested; at++) {
+        this_thread::sleep_until(start + chrono::duration<double>(min(at, seconds)));
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t states;
+        {
+            lock_guard<mutex> guard(fuzz->lock);
+            states = fuzz->corpus.size();
+        }
+        printf("%6.1f s  %10llu runs  %6.1fM instructions/s  %5zu states  %4u of %u instructions  deepest %llu ticks\n",
+               elapsed, (unsigned long long)fuzz->runs.load(), fuzz->instructions.load() / elapsed / 1e6, states,
+               covered(), reachable, (unsigned long long)deepest()->ticks);
+        fflush(stdout);
+        if (at >= seconds) break;
+    }
+    fuzz->stopping = true;
+    for (thread& t : threads) t.join();
+
+    // The count of covered instructions includes any reached only through
+    // paths the static walk couldn't follow
+    unsigned missed = 0;
+    for (unsigned a = 0x200; a < 4096; a += 2) missed += (map->flags[a] & MAP_INSTR) && !fuzz->seen[a >> 1];
+    printf("%u reachable instructions never ran\n", missed);
+
+    int status = 0;
+    if (record) {
+        const FuzzEntry* best  = deepest();
+        Trace*           trace = new Trace;
+        uint64_t         hash  = recordEntry(fuzz, best, trace);
+        if (!saveTrace(trace, record)) {
+            fprintf(stderr, "%s: cannot write trace\n", record);
+            status = 1;
+        } else {
+            printf("%s: %llu ticks to the deepest state, final frame %016llx\n", record,
+                   (unsigned long long)trace->ticks, (unsigned long long)hash);
+        }
+        delete trace;
+    }
+    return status;
+}
+
+int main(int argc, char** argv) {
+    // CHIP8 --bench [--csv] [--cycles n] [rom ...]
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return runBench(argc - 2, argv + 2);
+    }
+
+    // CHIP8 --analyze <rom>
+    if (argc > 2 && strcmp(argv[1], "--analyze") == 0) {
+        return analyzeMain(argv[2]);
+    }
+
+    // CHIP8 --fuzz <rom> ...
+    if (argc > 1 && strcmp(argv[1], "--fuzz") == 0) {
+        return fuzzMain(argc - 2, argv + 2);
+    }
+
+    // CHIP8 --diff <rom> ...
+    if (argc > 1 && strcmp(argv[1], "--diff") == 0) {
+        return diffMain(argc - 2, argv + 2);
+    }
+
+    // CHIP8 --decode <log>
+    if (argc > 2 && strcmp(argv[1], "--decode") == 0) {
+        return decodeLog(argv[2]);
+    }
+
+    // CHIP8 --headless <rom> ...
+    if (argc > 1 && strcmp(argv[1], "--headless") == 0) {
+        return headlessMain(argc - 2, argv + 2);
+    }
+
+    // CHIP8 --batch <list file> [workers]
+    if (argc > 2 && strcmp(argv[1], "--batch") == 0) {
+        return runBatch(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+    }
+
+    // CHIP8 --sessions <rom> <count> [frames] [threads]
+    if (argc > 3 && strcmp(argv[1], "--sessions") == 0) {
+#if CHIP8_COROUTINES
+        return runSessions(argv[2], atoi(argv[3]), argc > 4 ? strtoull(argv[4], nullptr, 10) : 600,
+                           argc > 5 ? atoi(argv[5]) : 2);
+#else
+        fprintf(stderr, "--sessions needs a C++20 build (-std=c++20)\n");
+        return 1;
+#endif
+    }
+
+    // CHIP8 --serve <rom> [port] [sessions], CHIP8 --watch <host> [port] [session]
+    if (argc > 2 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--watch") == 0)) {
+#ifndef _WIN32
+        const char* port = argc > 3 ? argv[3] : STREAM_PORT;
+        unsigned    n    = argc > 4 ? atoi(argv[4]) : argv[1][2] == 's';
+        return argv[1][2] == 's' ? runServer(argv[2], port, n ? n : 1) : runViewer(argv[2], port, n);
+#else
+        fprintf(stderr, "%s is not available on Windows\n", argv[1]);
+        return 1;
+#endif
+    }
+
+    // CHIP8 --host <rom> <instances> [frames] [workers]
+    if (argc > 3 && strcmp(argv[1], "--host") == 0) {
+        return runHost(argv[2], strtoull(argv[3], nullptr, 10), argc > 4 ? strtoull(argv[4], nullptr, 10) : 60,
+                       argc > 5 ? atoi(argv[5]) : 0);
+    }
+
+    // CHIP8 --grid <list file> [workers]
+    if (argc > 2 && strcmp(argv[1], "--grid") == 0) {
+#if CHIP8_GL
+        return runGrid(argv[2], argc > 3 ? atoi(argv[3]) : 0, &argc, argv);
+#else
+        fprintf(stderr, "--grid needs a build with -DCHIP8_GL=1\n");
+        return 1;
+#endif
+    }
+
+    // CHIP8 [--ipf n] [--unthrottled] [--jit] [--gl] [--quirks profile] [--ticks n] [--profile prefix] [--trace file] [--log file] [--seed n] <rom>
+    Scheduler sched;
+    QuirkProfile quirks = QUIRKS_CHIP8;
+    const char* rom     = nullptr;
+    const char* profile = nullptr;
+    const char* record  = nullptr;
+    const char* log     = nullptr;
+    uint64_t    ticks   = 0, seed = 0;
+    bool jit = false, gl = false, bad = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc)          sched.ipf = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--unthrottled") == 0)             sched.throttled = false;
+        else if (strcmp(argv[i], "--jit") == 0)                     jit = true;
+        else if (strcmp(argv[i], "--gl") == 0)                      gl = true;
+        else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc)   ticks = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profile = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)   record = argv[++i];
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc)     log = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)    seed = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc)  bad |= !parseQuirks(argv[++i], &quirks);
+        else rom = argv[i];
+    }
+    if (!rom || !sched.ipf || bad) {
+        fprintf(stderr, "usage: %s [--ipf n] [--unthrottled] [--jit] [--gl] [--quirks chip8|schip|xochip] [--ticks n] [--profile prefix] [--trace file] [--log file] [--seed n] <rom>\n", argv[0]);
+        return 1;
+    }
+    if (profile && !profiling) {
+        fprintf(stderr, "--profile needs a build with -DCHIP8_PROFILE=1\n");
+        return 1;
+    }
+    if (log && !logging) {
+        fprintf(stderr, "--log needs a build with CHIP8_LOG=1\n");
+        return 1;
+    }
+    if (gl && !CHIP8_GL) {
+        fprintf(stderr, "--gl needs a build with -DCHIP8_GL=1\n");
+        return 1;
+    }
+
+    Chip8* vm = new Chip8;
+    
+    // Load ROM, set up registers and Program Counter
+    if (!initVM (vm, rom)) {
+        fprintf(stderr, "%s: cannot load ROM (missing, empty or larger than %d bytes)\n", rom, ROM_MAX);
+        return 1;
+    }
+    useQuirks(vm, quirks);
+    seedRandom(&vm->rng, seed, 0);
+    if (jit) {
+        attachRecompiler(vm);
+        precompileROM(vm);
+    }
+    if (profile) vm->profile = new Profile;
+    if (log && !openLog(vm, log, false)) {
+        fprintf(stderr, "%s: cannot write log\n", log);
+        return 1;
+    }
+
+    // Keys from the window, or from the terminal
+    Keypad* keypad = new Keypad;
+    vm->keypad = keypad;
+    if (record) {
+        vm->trace          = new Trace;
+        vm->trace->ipf     = sched.ipf;
+        vm->trace->quirks  = quirks;
+        vm->trace->program = programHash(vm);
+    }
+    signal(SIGINT, [] (int) { stopRequested = 1; });
+
+    // Chip-8 Cycle, paced at 60 Hz
+#if CHIP8_GL
+    GLRenderer renderer;
+    if (gl) {
+        renderer.keypad = keypad;
+        if (!initGL(&renderer, &argc, argv, rom)) {
+            fprintf(stderr, "cannot set up OpenGL 4.4\n");
+            return 1;
+        }
+        sched.present = presentGL;
+        sched.poll    = pollGL;
+        sched.user    = &renderer;
+    }
+#endif
+    if (!sched.present) {
+        sched.present = presentTerminal;
+        printf("\x1b[2J");
+#ifndef _WIN32
+        startTerminalInput(keypad);
+#endif
+    }
+    runScheduler(&sched, vm, ticks);
+
+    uint64_t lost = 0;
+    if (log && !closeLog(vm, &lost)) {
+        fprintf(stderr, "%s: cannot write log\n", log);
+        return 1;
+    }
+    if (log && lost) fprintf(stderr, "%s: %llu instructions not logged, the drain fell behind\n", log, (unsigned long long)lost);
+
+    if (record) {
+        vm->trace->ticks = sched.ticks;
+        if (!saveTrace(vm->trace, record)) {
+            fprintf(stderr, "%s: cannot write trace\n", record);
+            return 1;
+        }
+    }
+
+    if (profile && !dumpProfile(vm->profile, profile)) {
+        fprintf(stderr, "%s: cannot write profile\n", profile);
+        return 1;
     }
+    return 0;
 }